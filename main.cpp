@@ -26,501 +26,4165 @@ struct TBlkDev
     int           (* m_Write ) ( int, int, const void *, int );
 };
 #endif /* __PROGTEST__ */
+#include <vector>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <list>
+#include <unordered_map>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <new>
+#include <bitset>
+// Builds with GCC or Clang on POSIX systems only: the code uses their builtins (__builtin_popcount,
+// __builtin_cpu_supports, target attributes), posix_memalign and std::thread on pthreads. The SIMD
+// kernels are left out on other CPUs than x86-64, the portable ones are used there.
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define RAID_X86_SIMD
+#endif
 
-class CRaidVolume
+// Building with RAID_LATENCY keeps latency histograms of requests and drive calls for GetLatency,
+// RAID_TRACE keeps the last RAID_TRACE_EVENTS of them for DumpTrace. Without them neither is compiled in.
+#if defined(RAID_LATENCY)
+#define RAID_LATENCY_SCOPE(histogram, count) CLatencyScope latencyScope(histogram, count)
+#else
+#define RAID_LATENCY_SCOPE(histogram, count)
+#endif
+#if defined(RAID_TRACE)
+#define RAID_TRACE_SCOPE(name, drive, secNr, secCnt) CTraceScope traceScope(tracer, name, drive, secNr, secCnt)
+#else
+#define RAID_TRACE_SCOPE(name, drive, secNr, secCnt)
+#endif
+
+// Number of rows handled together by one batch of device calls
+const int RAID_BATCH_ROWS = 128;
+// Unneeded sectors up to this count are read along to join two runs into one call
+const int RAID_READ_GAP = 2;
+// Rows rebuilt by one step of Resync, reading of the next step overlaps with writing this one
+const int RAID_RESYNC_ROWS = 1024;
+// Regions of the write-intent bitmap, one sector of bits per drive
+const int RAID_BITMAP_BITS = SECTOR_SIZE * 8;
+// Bits of regions not written during this many writes are cleared
+const int RAID_BITMAP_SWEEP = 256;
+// Chunk size used when Create is not given one, 4 KiB
+const int RAID_DEFAULT_CHUNK = 8;
+// Rows kept in the stripe cache unless SetCacheSize says otherwise
+const int RAID_CACHE_ROWS = 1024;
+// Shards of the stripe cache, each with its own lock and its part of the rows
+const int RAID_CACHE_SHARDS = 16;
+// Rows the write-back buffer holds before Write flushes it itself
+const int RAID_WRITEBACK_ROWS = 1024;
+// Background flusher wakes this often, rows buffered since its previous wake-up are written
+const int RAID_FLUSH_MS = 20;
+// Rows prefetched for a sequential reader. The window grows by the data every sequential Read
+// consumes, up to this many of its Reads, and is prefetched in whole chunks.
+const int RAID_READAHEAD_REQUESTS = 16;
+const int RAID_READAHEAD_MAX = 1024;
+// Sequential readers followed at once, each with its own windows
+const int RAID_READAHEAD_STREAMS = 8;
+// Threads running the steps of ReadAsync/WriteAsync requests. A step never waits for a drive,
+// so they keep any number of requests in flight.
+const int RAID_ASYNC_THREADS = 2;
+// Device calls running on a drive at once, see CDrivePool
+const int RAID_QUEUE_DEPTH = 4;
+// Alignment of buffers handed to the drives, backends doing direct I/O need it
+const int RAID_IO_ALIGN = 4096;
+// Locks stripes are hashed to, requests on stripes with different locks run in parallel
+const int RAID_STRIPE_LOCKS = 256;
+// Shards of the statistics counters, threads are spread over them so they rarely share one
+const int RAID_STAT_SHARDS = 16;
+const int RAID_CACHE_LINE = 64;
+// Every power of two of a latency histogram is split into this many buckets, 1/16 = 6 % precision
+const int RAID_HISTOGRAM_SUB_BITS = 4;
+// Events kept by the tracer, older ones are overwritten
+const int RAID_TRACE_EVENTS = 1 << 16;
+
+//-------------------------------------------------------------------------------------------------
+// XOR kernels. xorBlocks xors len bytes of src into dst, xorSources stores xor of all sources
+// into dst in a single pass (dst may be one of the sources). The best ones for the CPU are
+// picked once at startup.
+
+static void xorBlocksPortable(char *dst, const char *src, size_t len){
+    size_t i = 0;
+    // Going by 64 bit words, memcpy keeps it safe for unaligned buffers
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)){
+        uint64_t a, b;
+        memcpy(&a, dst + i, sizeof(a));
+        memcpy(&b, src + i, sizeof(b));
+        a ^= b;
+        memcpy(dst + i, &a, sizeof(a));
+    }
+    for (; i < len; i++){
+        dst[i] ^= src[i];
+    }
+}
+
+// Continues from byte i, SIMD kernels finish their tails here
+static void xorSourcesFrom(char *dst, const char **src, int n, size_t i, size_t len){
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)){
+        uint64_t a, b;
+        memcpy(&a, src[0] + i, sizeof(a));
+        for (int k = 1; k < n; k++){
+            memcpy(&b, src[k] + i, sizeof(b));
+            a ^= b;
+        }
+        memcpy(dst + i, &a, sizeof(a));
+    }
+    for (; i < len; i++){
+        char a = src[0][i];
+        for (int k = 1; k < n; k++){
+            a ^= src[k][i];
+        }
+        dst[i] = a;
+    }
+}
+
+static void xorSourcesPortable(char *dst, const char **src, int n, size_t len){
+    xorSourcesFrom(dst, src, n, 0, len);
+}
+
+#ifdef RAID_X86_SIMD
+static void xorBlocksSSE2(char *dst, const char *src, size_t len){
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64){
+        __m128i a0 = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i a1 = _mm_loadu_si128((const __m128i*)(dst + i + 16));
+        __m128i a2 = _mm_loadu_si128((const __m128i*)(dst + i + 32));
+        __m128i a3 = _mm_loadu_si128((const __m128i*)(dst + i + 48));
+        a0 = _mm_xor_si128(a0, _mm_loadu_si128((const __m128i*)(src + i)));
+        a1 = _mm_xor_si128(a1, _mm_loadu_si128((const __m128i*)(src + i + 16)));
+        a2 = _mm_xor_si128(a2, _mm_loadu_si128((const __m128i*)(src + i + 32)));
+        a3 = _mm_xor_si128(a3, _mm_loadu_si128((const __m128i*)(src + i + 48)));
+        _mm_storeu_si128((__m128i*)(dst + i), a0);
+        _mm_storeu_si128((__m128i*)(dst + i + 16), a1);
+        _mm_storeu_si128((__m128i*)(dst + i + 32), a2);
+        _mm_storeu_si128((__m128i*)(dst + i + 48), a3);
+    }
+    xorBlocksPortable(dst + i, src + i, len - i);
+}
+
+static void xorSourcesSSE2(char *dst, const char **src, int n, size_t len){
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64){
+        __m128i a0 = _mm_loadu_si128((const __m128i*)(src[0] + i));
+        __m128i a1 = _mm_loadu_si128((const __m128i*)(src[0] + i + 16));
+        __m128i a2 = _mm_loadu_si128((const __m128i*)(src[0] + i + 32));
+        __m128i a3 = _mm_loadu_si128((const __m128i*)(src[0] + i + 48));
+        for (int k = 1; k < n; k++){
+            a0 = _mm_xor_si128(a0, _mm_loadu_si128((const __m128i*)(src[k] + i)));
+            a1 = _mm_xor_si128(a1, _mm_loadu_si128((const __m128i*)(src[k] + i + 16)));
+            a2 = _mm_xor_si128(a2, _mm_loadu_si128((const __m128i*)(src[k] + i + 32)));
+            a3 = _mm_xor_si128(a3, _mm_loadu_si128((const __m128i*)(src[k] + i + 48)));
+        }
+        _mm_storeu_si128((__m128i*)(dst + i), a0);
+        _mm_storeu_si128((__m128i*)(dst + i + 16), a1);
+        _mm_storeu_si128((__m128i*)(dst + i + 32), a2);
+        _mm_storeu_si128((__m128i*)(dst + i + 48), a3);
+    }
+    xorSourcesFrom(dst, src, n, i, len);
+}
+
+__attribute__((target("avx2")))
+static void xorBlocksAVX2(char *dst, const char *src, size_t len){
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128){
+        __m256i a0 = _mm256_loadu_si256((const __m256i*)(dst + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i*)(dst + i + 32));
+        __m256i a2 = _mm256_loadu_si256((const __m256i*)(dst + i + 64));
+        __m256i a3 = _mm256_loadu_si256((const __m256i*)(dst + i + 96));
+        a0 = _mm256_xor_si256(a0, _mm256_loadu_si256((const __m256i*)(src + i)));
+        a1 = _mm256_xor_si256(a1, _mm256_loadu_si256((const __m256i*)(src + i + 32)));
+        a2 = _mm256_xor_si256(a2, _mm256_loadu_si256((const __m256i*)(src + i + 64)));
+        a3 = _mm256_xor_si256(a3, _mm256_loadu_si256((const __m256i*)(src + i + 96)));
+        _mm256_storeu_si256((__m256i*)(dst + i), a0);
+        _mm256_storeu_si256((__m256i*)(dst + i + 32), a1);
+        _mm256_storeu_si256((__m256i*)(dst + i + 64), a2);
+        _mm256_storeu_si256((__m256i*)(dst + i + 96), a3);
+    }
+    xorBlocksPortable(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void xorSourcesAVX2(char *dst, const char **src, int n, size_t len){
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128){
+        __m256i a0 = _mm256_loadu_si256((const __m256i*)(src[0] + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i*)(src[0] + i + 32));
+        __m256i a2 = _mm256_loadu_si256((const __m256i*)(src[0] + i + 64));
+        __m256i a3 = _mm256_loadu_si256((const __m256i*)(src[0] + i + 96));
+        for (int k = 1; k < n; k++){
+            a0 = _mm256_xor_si256(a0, _mm256_loadu_si256((const __m256i*)(src[k] + i)));
+            a1 = _mm256_xor_si256(a1, _mm256_loadu_si256((const __m256i*)(src[k] + i + 32)));
+            a2 = _mm256_xor_si256(a2, _mm256_loadu_si256((const __m256i*)(src[k] + i + 64)));
+            a3 = _mm256_xor_si256(a3, _mm256_loadu_si256((const __m256i*)(src[k] + i + 96)));
+        }
+        _mm256_storeu_si256((__m256i*)(dst + i), a0);
+        _mm256_storeu_si256((__m256i*)(dst + i + 32), a1);
+        _mm256_storeu_si256((__m256i*)(dst + i + 64), a2);
+        _mm256_storeu_si256((__m256i*)(dst + i + 96), a3);
+    }
+    xorSourcesFrom(dst, src, n, i, len);
+}
+
+__attribute__((target("avx512f")))
+static void xorBlocksAVX512(char *dst, const char *src, size_t len){
+    size_t i = 0;
+    for (; i + 256 <= len; i += 256){
+        __m512i a0 = _mm512_loadu_si512((const void*)(dst + i));
+        __m512i a1 = _mm512_loadu_si512((const void*)(dst + i + 64));
+        __m512i a2 = _mm512_loadu_si512((const void*)(dst + i + 128));
+        __m512i a3 = _mm512_loadu_si512((const void*)(dst + i + 192));
+        a0 = _mm512_xor_si512(a0, _mm512_loadu_si512((const void*)(src + i)));
+        a1 = _mm512_xor_si512(a1, _mm512_loadu_si512((const void*)(src + i + 64)));
+        a2 = _mm512_xor_si512(a2, _mm512_loadu_si512((const void*)(src + i + 128)));
+        a3 = _mm512_xor_si512(a3, _mm512_loadu_si512((const void*)(src + i + 192)));
+        _mm512_storeu_si512((void*)(dst + i), a0);
+        _mm512_storeu_si512((void*)(dst + i + 64), a1);
+        _mm512_storeu_si512((void*)(dst + i + 128), a2);
+        _mm512_storeu_si512((void*)(dst + i + 192), a3);
+    }
+    xorBlocksPortable(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx512f")))
+static void xorSourcesAVX512(char *dst, const char **src, int n, size_t len){
+    size_t i = 0;
+    for (; i + 256 <= len; i += 256){
+        __m512i a0 = _mm512_loadu_si512((const void*)(src[0] + i));
+        __m512i a1 = _mm512_loadu_si512((const void*)(src[0] + i + 64));
+        __m512i a2 = _mm512_loadu_si512((const void*)(src[0] + i + 128));
+        __m512i a3 = _mm512_loadu_si512((const void*)(src[0] + i + 192));
+        for (int k = 1; k < n; k++){
+            a0 = _mm512_xor_si512(a0, _mm512_loadu_si512((const void*)(src[k] + i)));
+            a1 = _mm512_xor_si512(a1, _mm512_loadu_si512((const void*)(src[k] + i + 64)));
+            a2 = _mm512_xor_si512(a2, _mm512_loadu_si512((const void*)(src[k] + i + 128)));
+            a3 = _mm512_xor_si512(a3, _mm512_loadu_si512((const void*)(src[k] + i + 192)));
+        }
+        _mm512_storeu_si512((void*)(dst + i), a0);
+        _mm512_storeu_si512((void*)(dst + i + 64), a1);
+        _mm512_storeu_si512((void*)(dst + i + 128), a2);
+        _mm512_storeu_si512((void*)(dst + i + 192), a3);
+    }
+    xorSourcesFrom(dst, src, n, i, len);
+}
+#endif /* RAID_X86_SIMD */
+
+typedef void (* TXorKernel)(char *, const char *, size_t);
+typedef void (* TXorSourcesKernel)(char *, const char **, int, size_t);
+
+static const TXorKernel         xorBlocksKernels[]  = { xorBlocksPortable,
+#ifdef RAID_X86_SIMD
+                                                        xorBlocksSSE2, xorBlocksAVX2, xorBlocksAVX512
+#endif
+                                                      };
+static const TXorSourcesKernel  xorSourcesKernels[] = { xorSourcesPortable,
+#ifdef RAID_X86_SIMD
+                                                        xorSourcesSSE2, xorSourcesAVX2, xorSourcesAVX512
+#endif
+                                                      };
+
+// Index of the widest kernel the CPU supports
+static int selectXorKernel(void){
+#ifdef RAID_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")){
+        return 3;
+    }
+    if (__builtin_cpu_supports("avx2")){
+        return 2;
+    }
+    // SSE2 is always there on x86-64
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+static const int               xorKernel  = selectXorKernel();
+static const TXorKernel        xorBlocks  = xorBlocksKernels[xorKernel];
+static const TXorSourcesKernel xorSources = xorSourcesKernels[xorKernel];
+
+//-------------------------------------------------------------------------------------------------
+// GF(2^8) kernels for the Q syndrome of dual parity. The field uses polynomial 0x11d and
+// generator 2. gfSources stores sum of coef[k] * src[k] into dst in a single pass (dst may be
+// one of the sources). A product is two lookups into 16 entry tables, one for each nibble,
+// which PSHUFB does for a whole register at once.
+
+struct TGfTables
+{
+    unsigned char m_Exp[510];
+    unsigned char m_Log[256];
+    // Products of every coefficient with all low nibbles, then with all high nibbles
+    unsigned char m_Nibbles[256][32];
+
+    TGfTables(){
+        int x = 1;
+        for (int i = 0; i < 255; i++){
+            m_Exp[i] = m_Exp[i + 255] = (unsigned char)x;
+            m_Log[x] = (unsigned char)i;
+            x = (x << 1) ^ (x & 0x80 ? 0x11d : 0);
+        }
+        m_Log[0] = 0;
+        for (int c = 0; c < 256; c++){
+            for (int n = 0; n < 16; n++){
+                m_Nibbles[c][n] = Mul(c, n);
+                m_Nibbles[c][16 + n] = Mul(c, n << 4);
+            }
+        }
+    }
+
+    unsigned char Mul(int a, int b) const {
+        return a && b ? m_Exp[m_Log[a] + m_Log[b]] : 0;
+    }
+
+    unsigned char Div(int a, int b) const {
+        return a ? m_Exp[m_Log[a] + 255 - m_Log[b]] : 0;
+    }
+
+    // Generator raised to e
+    unsigned char Pow(int e) const {
+        return m_Exp[e % 255];
+    }
+};
+
+static const TGfTables gfTables;
+
+// Continues from byte i, SIMD kernels finish their tails here
+static void gfSourcesFrom(char *dst, const char **src, const unsigned char *coef, int n, size_t i, size_t len){
+    for (; i < len; i++){
+        unsigned char a = 0;
+        for (int k = 0; k < n; k++){
+            unsigned char x = src[k][i];
+            const unsigned char *table = gfTables.m_Nibbles[coef[k]];
+            a ^= table[x & 0x0f] ^ table[16 + (x >> 4)];
+        }
+        dst[i] = a;
+    }
+}
+
+static void gfSourcesPortable(char *dst, const char **src, const unsigned char *coef, int n, size_t len){
+    gfSourcesFrom(dst, src, coef, n, 0, len);
+}
+
+#ifdef RAID_X86_SIMD
+__attribute__((target("ssse3")))
+static void gfSourcesSSSE3(char *dst, const char **src, const unsigned char *coef, int n, size_t len){
+    __m128i low[2 * MAX_RAID_DEVICES], high[2 * MAX_RAID_DEVICES];
+    for (int k = 0; k < n; k++){
+        low[k] = _mm_loadu_si128((const __m128i*)gfTables.m_Nibbles[coef[k]]);
+        high[k] = _mm_loadu_si128((const __m128i*)(gfTables.m_Nibbles[coef[k]] + 16));
+    }
+    const __m128i mask = _mm_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32){
+        __m128i a0 = _mm_setzero_si128();
+        __m128i a1 = _mm_setzero_si128();
+        for (int k = 0; k < n; k++){
+            __m128i x0 = _mm_loadu_si128((const __m128i*)(src[k] + i));
+            __m128i x1 = _mm_loadu_si128((const __m128i*)(src[k] + i + 16));
+            a0 = _mm_xor_si128(a0, _mm_shuffle_epi8(low[k], _mm_and_si128(x0, mask)));
+            a0 = _mm_xor_si128(a0, _mm_shuffle_epi8(high[k], _mm_and_si128(_mm_srli_epi64(x0, 4), mask)));
+            a1 = _mm_xor_si128(a1, _mm_shuffle_epi8(low[k], _mm_and_si128(x1, mask)));
+            a1 = _mm_xor_si128(a1, _mm_shuffle_epi8(high[k], _mm_and_si128(_mm_srli_epi64(x1, 4), mask)));
+        }
+        _mm_storeu_si128((__m128i*)(dst + i), a0);
+        _mm_storeu_si128((__m128i*)(dst + i + 16), a1);
+    }
+    gfSourcesFrom(dst, src, coef, n, i, len);
+}
+
+__attribute__((target("avx2")))
+static void gfSourcesAVX2(char *dst, const char **src, const unsigned char *coef, int n, size_t len){
+    __m256i low[2 * MAX_RAID_DEVICES], high[2 * MAX_RAID_DEVICES];
+    for (int k = 0; k < n; k++){
+        low[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)gfTables.m_Nibbles[coef[k]]));
+        high[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(gfTables.m_Nibbles[coef[k]] + 16)));
+    }
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64){
+        __m256i a0 = _mm256_setzero_si256();
+        __m256i a1 = _mm256_setzero_si256();
+        for (int k = 0; k < n; k++){
+            __m256i x0 = _mm256_loadu_si256((const __m256i*)(src[k] + i));
+            __m256i x1 = _mm256_loadu_si256((const __m256i*)(src[k] + i + 32));
+            a0 = _mm256_xor_si256(a0, _mm256_shuffle_epi8(low[k], _mm256_and_si256(x0, mask)));
+            a0 = _mm256_xor_si256(a0, _mm256_shuffle_epi8(high[k], _mm256_and_si256(_mm256_srli_epi64(x0, 4), mask)));
+            a1 = _mm256_xor_si256(a1, _mm256_shuffle_epi8(low[k], _mm256_and_si256(x1, mask)));
+            a1 = _mm256_xor_si256(a1, _mm256_shuffle_epi8(high[k], _mm256_and_si256(_mm256_srli_epi64(x1, 4), mask)));
+        }
+        _mm256_storeu_si256((__m256i*)(dst + i), a0);
+        _mm256_storeu_si256((__m256i*)(dst + i + 32), a1);
+    }
+    gfSourcesFrom(dst, src, coef, n, i, len);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void gfSourcesAVX512(char *dst, const char **src, const unsigned char *coef, int n, size_t len){
+    // Zero-masked forms of the broadcast and the shift, GCC 12 warns about the undefined
+    // pass-through operand of the plain ones
+    __m512i low[2 * MAX_RAID_DEVICES], high[2 * MAX_RAID_DEVICES];
+    for (int k = 0; k < n; k++){
+        low[k] = _mm512_maskz_broadcast_i32x4(0xffff, _mm_loadu_si128((const __m128i*)gfTables.m_Nibbles[coef[k]]));
+        high[k] = _mm512_maskz_broadcast_i32x4(0xffff, _mm_loadu_si128((const __m128i*)(gfTables.m_Nibbles[coef[k]] + 16)));
+    }
+    const __m512i mask = _mm512_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128){
+        __m512i a0 = _mm512_setzero_si512();
+        __m512i a1 = _mm512_setzero_si512();
+        for (int k = 0; k < n; k++){
+            __m512i x0 = _mm512_loadu_si512((const void*)(src[k] + i));
+            __m512i x1 = _mm512_loadu_si512((const void*)(src[k] + i + 64));
+            a0 = _mm512_xor_si512(a0, _mm512_shuffle_epi8(low[k], _mm512_and_si512(x0, mask)));
+            a0 = _mm512_xor_si512(a0, _mm512_shuffle_epi8(high[k], _mm512_and_si512(_mm512_maskz_srli_epi64(0xff, x0, 4), mask)));
+            a1 = _mm512_xor_si512(a1, _mm512_shuffle_epi8(low[k], _mm512_and_si512(x1, mask)));
+            a1 = _mm512_xor_si512(a1, _mm512_shuffle_epi8(high[k], _mm512_and_si512(_mm512_maskz_srli_epi64(0xff, x1, 4), mask)));
+        }
+        _mm512_storeu_si512((void*)(dst + i), a0);
+        _mm512_storeu_si512((void*)(dst + i + 64), a1);
+    }
+    gfSourcesFrom(dst, src, coef, n, i, len);
+}
+#endif /* RAID_X86_SIMD */
+
+typedef void (* TGfSourcesKernel)(char *, const char **, const unsigned char *, int, size_t);
+
+static const TGfSourcesKernel   gfSourcesKernels[]  = { gfSourcesPortable,
+#ifdef RAID_X86_SIMD
+                                                        gfSourcesSSSE3, gfSourcesAVX2, gfSourcesAVX512
+#endif
+                                                      };
+
+// Index of the widest kernel the CPU supports, byte shuffles of AVX-512 need its BW part
+static int selectGfKernel(void){
+#ifdef RAID_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")){
+        return 3;
+    }
+    if (__builtin_cpu_supports("avx2")){
+        return 2;
+    }
+    if (__builtin_cpu_supports("ssse3")){
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+static const int               gfKernel   = selectGfKernel();
+static const TGfSourcesKernel  gfSources  = gfSourcesKernels[gfKernel];
+
+//-------------------------------------------------------------------------------------------------
+// Sectors of consecutive rows, stored as one block per drive, so that a run
+// of rows on a single drive can be read or written by one device call
+struct TRowBatch
+{
+    int                 m_FirstRow;
+    int                 m_Rows;
+    // Aligned to RAID_IO_ALIGN, so every sector handed to a drive is aligned as well
+    std::unique_ptr<char, decltype(&free)> m_Data;
+    size_t              m_Size;
+
+    TRowBatch() : m_FirstRow(0), m_Rows(0), m_Data(NULL, &free), m_Size(0) {}
+
+    void Init(int drives, int firstRow, int rows){
+        m_FirstRow = firstRow;
+        m_Rows = rows;
+
+        size_t size = (size_t)drives * rows * SECTOR_SIZE;
+        if (size > m_Size){
+            void *data;
+            if (posix_memalign(&data, RAID_IO_ALIGN, size) != 0){
+                throw std::bad_alloc();
+            }
+            m_Data.reset((char*)data);
+            m_Size = size;
+        }
+    }
+
+    char *Sector(int drive, int row){
+        return m_Data.get() + ((size_t)drive * m_Rows + row - m_FirstRow) * SECTOR_SIZE;
+    }
+};
+
+//-------------------------------------------------------------------------------------------------
+// Part of the caller's buffer for Readv/Writev, segments together hold consecutive sectors
+struct TRaidSegment
 {
+    void              * m_Data;
+    int                 m_SecCnt;
+};
+
+//-------------------------------------------------------------------------------------------------
+// Sectors of the segments by their index in the request. Lookups move a cursor (segment and
+// index of its first sector), sectors are mostly visited in order so it rarely moves far.
+class CSegmentCursor {
 public:
-    CRaidVolume();
-    static bool              Create                        ( const TBlkDev   & dev );
-    int                      Start                         ( const TBlkDev   & dev );
-    int                      Stop                          ( void );
-    int                      Resync                        ( void );
-    int                      Status                        ( void ) const;
-    int                      Size                          ( void ) const;
-    bool                     Read                          ( int               secNr,
-                                                             void            * data,
-                                                             int               secCnt );
-    bool                     Write                         ( int               secNr,
-                                                             const void      * data,
-                                                             int               secCnt );
-protected:
-    int raidStatus;
-    int raidServiceData;
-    int raidFailedDrive;
-    int sectorNum;
-    int deviceNum;
-                            //( diskNr, secNr, data, secCnt )
-    int (*driveRead) ( int, int, void *, int );
-    int (*driveWrite) ( int, int, const void *, int );
+    CSegmentCursor(const TRaidSegment *segments, int segCnt) : m_Segments(segments), m_Count(0), m_Skip(0), m_Segment(0), m_First(0) {
+        long long count = 0;
+        for (int i = 0; i < segCnt && count >= 0; i++){
+            count = segments[i].m_SecCnt < 0 ? -1 : count + segments[i].m_SecCnt;
+            if (count > (long long)MAX_DEVICE_SECTORS * MAX_RAID_DEVICES){
+                count = -1;
+            }
+        }
+        m_Count = (int)count;
+    }
+
+    // Rest of the cursor after its first skip sectors
+    CSegmentCursor(const CSegmentCursor &from, int skip)
+        : m_Segments(from.m_Segments), m_Count(from.m_Count - skip), m_Skip(from.m_Skip + skip), m_Segment(0), m_First(0) {}
+
+    // Sectors of all segments, -1 if a segment has a negative count
+    int Count(void) const {
+        return m_Count;
+    }
+
+    char *operator[](int sector) const {
+        sector += m_Skip;
+        while (sector < m_First){
+            m_First -= m_Segments[--m_Segment].m_SecCnt;
+        }
+        while (sector >= m_First + m_Segments[m_Segment].m_SecCnt){
+            m_First += m_Segments[m_Segment++].m_SecCnt;
+        }
+        return (char*)m_Segments[m_Segment].m_Data + (size_t)(sector - m_First) * SECTOR_SIZE;
+    }
+
+private:
+    const TRaidSegment *m_Segments;
+    int                 m_Count;
+    int                 m_Skip;
+    mutable int         m_Segment;
+    mutable int         m_First;
+};
+
+//-------------------------------------------------------------------------------------------------
+// Device calls of a batch, worked out before they run, and what is made of their sectors afterwards
+struct TBatchPlan
+{
+    // Ways the parity of a written row is made
+    enum { ROW_NONE, ROW_FULL, ROW_RMW, ROW_RECONSTRUCT, ROW_RECOVER };
+
+    // Sectors the drives read or write
+    std::vector<char>   m_Sectors;
+    // Drives failed in the rows of the batch
+    int                 m_Lost;
+    // Read: lost sectors that are wanted and rows they are recovered in
+    std::vector<char>   m_LostSectors;
+    std::vector<char>   m_Degraded;
+    // Write: drives getting new data in every row and the way its parity is made
+    std::vector<int>    m_Written;
+    std::vector<char>   m_Mode;
+    // New data of an async write, NULL if the sector is not written
+    std::vector<const char*> m_NewData;
+};
+
+//-------------------------------------------------------------------------------------------------
+// Row of the write-back buffer, data written to it but not yet to the drives
+struct TDirtyRow
+{
+    // Flusher wake-up the row was buffered after
+    int                 m_Tick;
+    // Data sectors written, the row is full at deviceNum-parityNum
+    int                 m_Sectors;
+    // Bit per drive whose sector is buffered
+    int                 m_Mask;
+    std::vector<char>   m_Data;
+};
+
+//-------------------------------------------------------------------------------------------------
+// Counters since the volume was created, see GetStats
+struct TRaidStats
+{
+    // Calls of driveRead/driveWrite and sectors they moved, by drive
+    long long           m_DriveReads[MAX_RAID_DEVICES];
+    long long           m_DriveReadSectors[MAX_RAID_DEVICES];
+    long long           m_DriveWrites[MAX_RAID_DEVICES];
+    long long           m_DriveWriteSectors[MAX_RAID_DEVICES];
+    // Rows written by the way their parity was made: whole row, read-modify-write,
+    // reconstruct-write, and with lost data recovered first
+    long long           m_FullRows;
+    long long           m_RmwRows;
+    long long           m_ReconstructRows;
+    long long           m_RecoverRows;
+    // Rows read with lost sectors recovered from the rest of the row
+    long long           m_DegradedRows;
+    // Bytes of sources run through the parity kernels
+    long long           m_ParityBytes;
+    long long           m_ResyncRows;
+};
+
+//-------------------------------------------------------------------------------------------------
+// Paths timed by GetLatency, drive calls by drive
+const int RAID_PATH_READ = 0;
+const int RAID_PATH_WRITE = 1;
+const int RAID_PATH_RESYNC_ROW = 2;
+const int RAID_PATH_DRIVE_READ = 3;
+const int RAID_PATH_DRIVE_WRITE = 4;
+
+// Latency of a path in nanoseconds, percentiles are the upper bounds of their buckets up to m_Max
+struct TRaidLatency
+{
+    long long           m_Count;
+    long long           m_Mean;
+    long long           m_P50;
+    long long           m_P90;
+    long long           m_P99;
+    long long           m_P999;
+    long long           m_Max;
+};
+
+//-------------------------------------------------------------------------------------------------
+// Least recently used rows with the sectors of every drive that are known to match the disks.
+// Sectors of the failed drive hold what the rest of the row says they are. Stripes are hashed to
+// shards like to CStripeLocks, each shard is a cache of its own, so requests on other stripes
+// rarely wait for each other.
+class CStripeCache
+{
+public:
+    CStripeCache() : m_ChunkSectors(1) {}
+
+    // Shards get an equal part of capacity, rounded up
+    void Init(int drives, int capacity, int chunkSectors){
+        m_ChunkSectors = max(chunkSectors, 1);
+        int shardCapacity = (max(capacity, 0) + RAID_CACHE_SHARDS - 1) / RAID_CACHE_SHARDS;
+        for (TShard &shard : m_Shards){
+            std::lock_guard<std::mutex> lock(shard.m_Mutex);
+            shard.m_Drives = drives;
+            shard.m_Capacity = shardCapacity;
+            shard.m_Rows.clear();
+            shard.m_Index.clear();
+        }
+    }
+
+    void Clear(void){
+        for (TShard &shard : m_Shards){
+            std::lock_guard<std::mutex> lock(shard.m_Mutex);
+            shard.m_Rows.clear();
+            shard.m_Index.clear();
+        }
+    }
+
+    // Copies the sector into data, false if it is not cached
+    bool Get(int row, int drive, char *data){
+        TShard &shard = this->shard(row);
+        std::lock_guard<std::mutex> lock(shard.m_Mutex);
+        if (shard.m_Capacity == 0){
+            return false;
+        }
+        auto it = shard.m_Index.find(row);
+        if (it == shard.m_Index.end() || !(it->second->m_Valid & (1 << drive))){
+            shard.m_Misses++;
+            return false;
+        }
+        shard.m_Rows.splice(shard.m_Rows.begin(), shard.m_Rows, it->second);
+        memcpy(data, it->second->Sector(drive), SECTOR_SIZE);
+        shard.m_Hits++;
+        return true;
+    }
+
+    void Put(int row, int drive, const char *data){
+        TShard &shard = this->shard(row);
+        std::lock_guard<std::mutex> lock(shard.m_Mutex);
+        if (shard.m_Capacity == 0){
+            return;
+        }
+        auto it = shard.m_Index.find(row);
+        if (it != shard.m_Index.end()){
+            shard.m_Rows.splice(shard.m_Rows.begin(), shard.m_Rows, it->second);
+        } else if ((int)shard.m_Rows.size() < shard.m_Capacity){
+            shard.m_Rows.emplace_front();
+            shard.m_Rows.front().m_Data.resize((size_t)shard.m_Drives * SECTOR_SIZE);
+        } else {
+            // Least recently used row is reused for the new one
+            shard.m_Index.erase(shard.m_Rows.back().m_Row);
+            shard.m_Rows.splice(shard.m_Rows.begin(), shard.m_Rows, std::prev(shard.m_Rows.end()));
+        }
+        TRow &entry = shard.m_Rows.front();
+        if (it == shard.m_Index.end()){
+            entry.m_Row = row;
+            entry.m_Valid = 0;
+            shard.m_Index[row] = shard.m_Rows.begin();
+        }
+        memcpy(entry.Sector(drive), data, SECTOR_SIZE);
+        entry.m_Valid |= 1 << drive;
+    }
+
+    void Drop(int row, int drive){
+        TShard &shard = this->shard(row);
+        std::lock_guard<std::mutex> lock(shard.m_Mutex);
+        auto it = shard.m_Index.find(row);
+        if (it != shard.m_Index.end()){
+            it->second->m_Valid &= ~(1 << drive);
+        }
+    }
+
+    long long Hits(void) const {
+        long long hits = 0;
+        for (const TShard &shard : m_Shards){
+            std::lock_guard<std::mutex> lock(shard.m_Mutex);
+            hits += shard.m_Hits;
+        }
+        return hits;
+    }
+
+    long long Misses(void) const {
+        long long misses = 0;
+        for (const TShard &shard : m_Shards){
+            std::lock_guard<std::mutex> lock(shard.m_Mutex);
+            misses += shard.m_Misses;
+        }
+        return misses;
+    }
+
+private:
+    struct TRow
+    {
+        int                 m_Row;
+        // Bit per drive whose sector is cached
+        int                 m_Valid;
+        std::vector<char>   m_Data;
+
+        char *Sector(int drive){
+            return &m_Data[(size_t)drive * SECTOR_SIZE];
+        }
+    };
+
+    // Rows of different requests share a shard, a row itself is only touched under its stripe lock
+    struct TShard
+    {
+        TShard() : m_Drives(0), m_Capacity(0), m_Hits(0), m_Misses(0) {}
+
+        mutable std::mutex                              m_Mutex;
+        int                                             m_Drives;
+        int                                             m_Capacity;
+        long long                                       m_Hits;
+        long long                                       m_Misses;
+        // Most recently used first
+        std::list<TRow>                                 m_Rows;
+        std::unordered_map<int, std::list<TRow>::iterator> m_Index;
+    };
+
+    TShard &shard(int row){
+        return m_Shards[row / m_ChunkSectors % RAID_CACHE_SHARDS];
+    }
+
+    int                                             m_ChunkSectors;
+    TShard                                          m_Shards[RAID_CACHE_SHARDS];
+};
+
+//-------------------------------------------------------------------------------------------------
+// Counts down finished jobs, Wait blocks until all of them are done
+class CLatch
+{
+public:
+    explicit CLatch(int count) : m_Count(count) {}
+
+    void Done(void){
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        if (--m_Count == 0){
+            m_Cond.notify_all();
+        }
+    }
+
+    void Wait(void){
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_Cond.wait(lock, [this]{ return m_Count == 0; });
+    }
+
+private:
+    int                     m_Count;
+    std::mutex              m_Mutex;
+    std::condition_variable m_Cond;
+};
+
+//-------------------------------------------------------------------------------------------------
+// Rows prefetched for a sequential reader. Every drive reads the window in pieces of RAID_BATCH_ROWS
+// rows, a reader waits only for the pieces it needs and takes them as soon as they arrive.
+class CReadaheadWindow
+{
+public:
+    CReadaheadWindow(int drives, int firstRow, int rows, int lost)
+            : m_Lost(lost), m_Pieces((rows + RAID_BATCH_ROWS - 1) / RAID_BATCH_ROWS) {
+        m_Batch.Init(drives, firstRow, rows);
+        m_State.assign((size_t)drives * m_Pieces, PIECE_PENDING);
+        // Lost drives are not read at all
+        for (int drive = 0; drive < drives; drive++){
+            if (lost & (1 << drive)){
+                std::fill(m_State.begin() + drive * m_Pieces, m_State.begin() + (drive + 1) * m_Pieces, PIECE_FAILED);
+            }
+        }
+    }
+
+    TRowBatch               m_Batch;
+    // Drives left out, their sectors are calculated by the normal reads
+    int                     m_Lost;
+    int                     m_Pieces;
+    // Versions of the stripe locks when the prefetch started
+    std::vector<unsigned>   m_Versions;
+
+    int FirstRow(void) const { return m_Batch.m_FirstRow; }
+    int EndRow(void) const { return m_Batch.m_FirstRow + m_Batch.m_Rows; }
+    int Piece(int row) const { return (row - m_Batch.m_FirstRow) / RAID_BATCH_ROWS; }
+
+    void Done(int drive, int piece, bool ok){
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_State[drive * m_Pieces + piece] = ok ? PIECE_READ : PIECE_FAILED;
+        m_Cond.notify_all();
+    }
+
+    // Waits for a piece of the drive, false if it could not be read
+    bool Wait(int drive, int piece){
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        char &state = m_State[drive * m_Pieces + piece];
+        m_Cond.wait(lock, [&state]{ return state != PIECE_PENDING; });
+        return state == PIECE_READ;
+    }
+
+    // Like Wait, but a piece still being read is not waited for
+    bool Arrived(int drive, int piece){
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        return m_State[drive * m_Pieces + piece] == PIECE_READ;
+    }
+
+    // Waits until no drive uses the buffer any more
+    void WaitAll(void){
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_Cond.wait(lock, [this]{ return std::find(m_State.begin(), m_State.end(), PIECE_PENDING) == m_State.end(); });
+    }
+
+private:
+    enum { PIECE_PENDING, PIECE_READ, PIECE_FAILED };
+
+    std::vector<char>       m_State;
+    std::mutex              m_Mutex;
+    std::condition_variable m_Cond;
+};
+
+// A sequential reader, the next window starts once the reader is past the middle of the current one
+struct TReadaheadStream
+{
+    TReadaheadStream() : m_Next(-1), m_Window(0), m_Tick(0) {}
+
+    // Sector the next sequential Read starts at, -1 if the stream is unused
+    int                 m_Next;
+    // Rows of the next window
+    int                 m_Window;
+    // Last Read of the stream, the least recently used stream gives way to a new one
+    unsigned            m_Tick;
+    std::shared_ptr<CReadaheadWindow> m_Current;
+    std::shared_ptr<CReadaheadWindow> m_Ahead;
+};
+
+//-------------------------------------------------------------------------------------------------
+// Threads running device calls, up to the queue depth of them on every drive. Calls to one drive
+// overlap just like calls to different drives, so the backend has to take concurrent calls on a
+// drive; callers order the calls that depend on each other themselves. Jobs of a drive start in
+// the order they were queued.
+class CDrivePool
+{
+public:
+    CDrivePool() : m_Drives(0), m_Depth(1) {}
+    ~CDrivePool(){ Stop(); }
+
+    void Start(int drives, int depth){
+        Stop();
+        m_Drives = drives;
+        m_Depth = depth;
+        m_Queues.reset(new TQueue[drives]);
+        for (int i = 0; i < drives; i++){
+            for (int j = 0; j < depth; j++){
+                m_Queues[i].m_Threads.emplace_back(&CDrivePool::worker, this, i);
+            }
+        }
+    }
+
+    void Stop(void){
+        for (int i = 0; i < m_Drives; i++){
+            {
+                std::lock_guard<std::mutex> lock(m_Queues[i].m_Mutex);
+                m_Queues[i].m_Stop = true;
+            }
+            m_Queues[i].m_Cond.notify_all();
+            for (std::thread &thread : m_Queues[i].m_Threads){
+                thread.join();
+            }
+        }
+        m_Drives = 0;
+        m_Queues.reset();
+    }
+
+    // Queues job on the threads of given drive
+    void Submit(int drive, std::function<void()> job){
+        {
+            std::lock_guard<std::mutex> lock(m_Queues[drive].m_Mutex);
+            m_Queues[drive].m_Jobs.push_back(std::move(job));
+        }
+        m_Queues[drive].m_Cond.notify_one();
+    }
+
+    // Runs job(drive) for every drive in the mask, each on its own thread, and waits for all
+    void Run(int driveMask, const std::function<void(int)> &job){
+        int count = 0;
+        int single = -1;
+        for (int i = 0; i < m_Drives; i++){
+            if (driveMask & (1 << i)){
+                count++;
+                single = i;
+            }
+        }
+
+        // Nothing to overlap with, no need to switch threads unless the drive is fully busy
+        if (count == 0){
+            return;
+        }
+        if (count == 1 && claim(single)){
+            job(single);
+            release(single);
+            return;
+        }
+
+        CLatch latch(count);
+        for (int i = 0; i < m_Drives; i++){
+            if (driveMask & (1 << i)){
+                Submit(i, [&job, &latch, i]{
+                    job(i);
+                    latch.Done();
+                });
+            }
+        }
+        latch.Wait();
+    }
+
+    // Like Run, but returns right away. Done runs on the drive thread finishing the last job.
+    void RunAsync(int driveMask, std::function<void(int)> job, std::function<void()> done){
+        std::shared_ptr<TRun> run(new TRun(std::move(job), std::move(done)));
+        for (int i = 0; i < m_Drives; i++){
+            if (driveMask & (1 << i)){
+                run->m_Left++;
+            }
+        }
+        if (run->m_Left == 0){
+            run->m_Done();
+            return;
+        }
+        for (int i = 0; i < m_Drives; i++){
+            if (driveMask & (1 << i)){
+                Submit(i, [run, i]{
+                    run->m_Job(i);
+                    if (--run->m_Left == 0){
+                        run->m_Done();
+                    }
+                });
+            }
+        }
+    }
+
+private:
+    struct TQueue
+    {
+        TQueue() : m_Running(0), m_Stop(false) {}
+
+        std::vector<std::thread>            m_Threads;
+        std::mutex                          m_Mutex;
+        std::condition_variable             m_Cond;
+        std::deque<std::function<void()> >  m_Jobs;
+        // Jobs running on the drive, on its threads or inline
+        int                                 m_Running;
+        bool                                m_Stop;
+    };
+
+    struct TRun
+    {
+        TRun(std::function<void(int)> job, std::function<void()> done)
+            : m_Job(std::move(job)), m_Done(std::move(done)), m_Left(0) {}
+
+        std::function<void(int)>            m_Job;
+        std::function<void()>               m_Done;
+        std::atomic<int>                    m_Left;
+    };
+
+    void worker(int drive){
+        TQueue &queue = m_Queues[drive];
+        while (true){
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(queue.m_Mutex);
+                // Jobs run inline by other threads count against the depth as well
+                queue.m_Cond.wait(lock, [this, &queue]{
+                    return queue.m_Jobs.empty() ? queue.m_Stop : queue.m_Running < m_Depth;
+                });
+                if (queue.m_Jobs.empty()){
+                    return;
+                }
+                job = std::move(queue.m_Jobs.front());
+                queue.m_Jobs.pop_front();
+                queue.m_Running++;
+            }
+            job();
+            std::lock_guard<std::mutex> lock(queue.m_Mutex);
+            queue.m_Running--;
+        }
+    }
+
+    // Takes a free slot of the drive for a job run on the calling thread
+    bool claim(int drive){
+        std::lock_guard<std::mutex> lock(m_Queues[drive].m_Mutex);
+        if (!m_Queues[drive].m_Jobs.empty() || m_Queues[drive].m_Running >= m_Depth){
+            return false;
+        }
+        m_Queues[drive].m_Running++;
+        return true;
+    }
+
+    void release(int drive){
+        {
+            std::lock_guard<std::mutex> lock(m_Queues[drive].m_Mutex);
+            m_Queues[drive].m_Running--;
+        }
+        m_Queues[drive].m_Cond.notify_one();
+    }
+
+    int                         m_Drives;
+    int                         m_Depth;
+    std::unique_ptr<TQueue[]>   m_Queues;
+};
+
+//-------------------------------------------------------------------------------------------------
+// Row locks hashed by stripe. A request takes the locks of all stripes it touches at once, so
+// requests on disjoint stripes run in parallel and never deadlock. Reads share their locks, writes
+// and resync hold them alone. Requests that have to wait are granted in the order they came, a
+// read does not pass a write waiting for its locks, so none of them starves. Locks are not tied
+// to a thread, an async request releases them on whichever worker finishes it. Releasing after a
+// write bumps the version of the lock, so reads done without the lock (readahead, resync) can tell
+// whether their rows were written in the meantime.
+typedef std::bitset<RAID_STRIPE_LOCKS> TStripeSet;
+
+class CStripeLocks
+{
+public:
+    // Shared by readers, held alone by resync steps, held alone and versions bumped by writes
+    enum { LOCK_SHARED, LOCK_EXCLUSIVE, LOCK_WRITE };
+
+    CStripeLocks() : m_ChunkSectors(1) {
+        for (int i = 0; i < RAID_STRIPE_LOCKS; i++){
+            m_Readers[i] = 0;
+            m_Versions[i] = 0;
+        }
+    }
+
+    void Init(int chunkSectors){
+        m_ChunkSectors = chunkSectors;
+    }
+
+    int Lock(int row) const {
+        return row / m_ChunkSectors % RAID_STRIPE_LOCKS;
+    }
+
+    // Locks of all stripes from firstRow to lastRow. Requests lock at most half of the stripes at
+    // once, see CRaidVolume::lockWindow, only rows a resync step skipped may take all of them.
+    TStripeSet Rows(int firstRow, int lastRow) const {
+        TStripeSet set;
+        if (lastRow < firstRow){
+            return set;
+        }
+        int first = firstRow / m_ChunkSectors;
+        int last = lastRow / m_ChunkSectors;
+        if (last - first + 1 >= RAID_STRIPE_LOCKS){
+            return set.set();
+        }
+        for (int stripe = first; stripe <= last; stripe++){
+            set.set(stripe % RAID_STRIPE_LOCKS);
+        }
+        return set;
+    }
+
+    void Acquire(const TStripeSet &set, int mode){
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        if (free(set, mode)){
+            take(set, mode);
+            return;
+        }
+        bool granted = false;
+        m_Waiters.push_back(TWaiter{set, mode, NULL, &granted});
+        wait(set, mode);
+        m_Cond.wait(lock, [&granted]{ return granted; });
+    }
+
+    // Calls granted once the locks are taken, right away or from the Release that frees them
+    void AcquireAsync(const TStripeSet &set, int mode, std::function<void()> granted){
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            if (!free(set, mode)){
+                m_Waiters.push_back(TWaiter{set, mode, std::move(granted), NULL});
+                wait(set, mode);
+                return;
+            }
+            take(set, mode);
+        }
+        granted();
+    }
+
+    void Release(const TStripeSet &set, int mode){
+        std::vector<std::function<void()> > granted;
+        bool wake = false;
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            for (int i = 0; i < RAID_STRIPE_LOCKS; i++){
+                if (!set[i]){
+                    continue;
+                }
+                if (mode == LOCK_WRITE){
+                    m_Versions[i]++;
+                }
+                if (mode == LOCK_SHARED && --m_Readers[i] == 0){
+                    m_Shared.reset(i);
+                }
+            }
+            if (mode != LOCK_SHARED){
+                m_Held &= ~set;
+            }
+
+            // Waiters go in order, one is passed over only if it needs a lock an earlier one waits for
+            m_Waiting.reset();
+            m_WaitingShared.reset();
+            for (auto it = m_Waiters.begin(); it != m_Waiters.end(); ){
+                if (!free(it->m_Set, it->m_Mode)){
+                    wait(it->m_Set, it->m_Mode);
+                    ++it;
+                    continue;
+                }
+                take(it->m_Set, it->m_Mode);
+                if (it->m_Granted){
+                    *it->m_Granted = true;
+                    wake = true;
+                } else {
+                    granted.push_back(std::move(it->m_Callback));
+                }
+                it = m_Waiters.erase(it);
+            }
+        }
+        if (wake){
+            m_Cond.notify_all();
+        }
+        for (std::function<void()> &callback : granted){
+            callback();
+        }
+    }
+
+    unsigned Version(int lock) const {
+        return m_Versions[lock];
+    }
+
+private:
+    // Request waiting for its locks, woken through the flag or called back
+    struct TWaiter
+    {
+        TStripeSet              m_Set;
+        int                     m_Mode;
+        std::function<void()>   m_Callback;
+        bool                  * m_Granted;
+    };
+
+    // Locks held by nobody the request can not share them with, nor wanted by such a request that came earlier
+    bool free(const TStripeSet &set, int mode) const {
+        if (mode == LOCK_SHARED){
+            return (set & (m_Held | m_Waiting)).none();
+        }
+        return (set & (m_Held | m_Shared | m_Waiting | m_WaitingShared)).none();
+    }
+
+    void take(const TStripeSet &set, int mode){
+        if (mode != LOCK_SHARED){
+            m_Held |= set;
+            return;
+        }
+        for (int i = 0; i < RAID_STRIPE_LOCKS; i++){
+            if (set[i]){
+                m_Readers[i]++;
+            }
+        }
+        m_Shared |= set;
+    }
+
+    void wait(const TStripeSet &set, int mode){
+        (mode == LOCK_SHARED ? m_WaitingShared : m_Waiting) |= set;
+    }
+
+    int                     m_ChunkSectors;
+    std::mutex              m_Mutex;
+    std::condition_variable m_Cond;
+    // Locks held alone, and shared by readers with their count
+    TStripeSet              m_Held;
+    TStripeSet              m_Shared;
+    int                     m_Readers[RAID_STRIPE_LOCKS];
+    // Locks wanted by the waiters, by those that hold them alone and by readers
+    TStripeSet              m_Waiting;
+    TStripeSet              m_WaitingShared;
+    std::list<TWaiter>      m_Waiters;
+    std::atomic<unsigned>   m_Versions[RAID_STRIPE_LOCKS];
+};
+
+// Holds stripe locks for the rest of the scope
+class CStripeGuard
+{
+public:
+    CStripeGuard(CStripeLocks &locks, const TStripeSet &set, int mode)
+        : m_Locks(locks), m_Set(set), m_Mode(mode) {
+        m_Locks.Acquire(m_Set, m_Mode);
+    }
+    ~CStripeGuard(){
+        m_Locks.Release(m_Set, m_Mode);
+    }
+
+private:
+    CStripeLocks           &m_Locks;
+    TStripeSet              m_Set;
+    int                     m_Mode;
+};
+
+//-------------------------------------------------------------------------------------------------
+// Request of ReadAsync/WriteAsync. Async workers take it from step to step, every step ends by
+// handing it to the locks, drive calls or bitmap write it needs next, which post the next step.
+struct TAsyncOp
+{
+    TAsyncOp(bool write, int secNr, void *data, int secCnt, std::function<void(bool)> done)
+        : m_Write(write), m_SecNr(secNr), m_Segment{data, secCnt}, m_Data(&m_Segment, 1), m_SecCnt(secCnt),
+          m_Request(&m_Segment, 1), m_RequestNr(secNr), m_RequestCnt(secCnt),
+          m_Done(std::move(done)), m_FirstRow(0), m_LastRow(-1), m_Row(0), m_Locked(false), m_Dirty(false) {}
+
+    bool                        m_Write;
+    // Lock window in progress, see CRaidVolume::lockWindow, and the whole request
+    int                         m_SecNr;
+    TRaidSegment                m_Segment;
+    CSegmentCursor              m_Data;
+    int                         m_SecCnt;
+    CSegmentCursor              m_Request;
+    int                         m_RequestNr;
+    int                         m_RequestCnt;
+    std::function<void(bool)>   m_Done;
+    // Rows of the request, m_Row starts the batch in progress
+    int                         m_FirstRow;
+    int                         m_LastRow;
+    int                         m_Row;
+    TStripeSet                  m_Locks;
+    // Locks held, rows marked in the bitmap
+    bool                        m_Locked;
+    bool                        m_Dirty;
+    TRowBatch                   m_Batch;
+    TBatchPlan                  m_Plan;
+#if defined(RAID_LATENCY)
+    std::chrono::steady_clock::time_point m_Started;
+#endif
+};
+
+//-------------------------------------------------------------------------------------------------
+// Counters of TRaidStats. Every thread adds to its own shard, shards sit in cache lines of their own,
+// so the hot path never waits for or bounces a line with other threads. Snapshot sums the shards.
+enum TRaidCounter
+{
+    STAT_DRIVE_READS            = 0,
+    STAT_DRIVE_READ_SECTORS     = STAT_DRIVE_READS + MAX_RAID_DEVICES,
+    STAT_DRIVE_WRITES           = STAT_DRIVE_READ_SECTORS + MAX_RAID_DEVICES,
+    STAT_DRIVE_WRITE_SECTORS    = STAT_DRIVE_WRITES + MAX_RAID_DEVICES,
+    STAT_FULL_ROWS              = STAT_DRIVE_WRITE_SECTORS + MAX_RAID_DEVICES,
+    STAT_RMW_ROWS,
+    STAT_RECONSTRUCT_ROWS,
+    STAT_RECOVER_ROWS,
+    STAT_DEGRADED_ROWS,
+    STAT_PARITY_BYTES,
+    STAT_RESYNC_ROWS,
+    STAT_COUNT
+};
+
+class CRaidCounters
+{
+public:
+    CRaidCounters(){
+        for (int i = 0; i < RAID_STAT_SHARDS; i++){
+            for (int j = 0; j < STAT_COUNT; j++){
+                m_Shards[i].m_Values[j] = 0;
+            }
+        }
+    }
+
+    void Add(int counter, long long value){
+        m_Shards[shard()].m_Values[counter].fetch_add(value, std::memory_order_relaxed);
+    }
+
+    TRaidStats Snapshot(void) const {
+        long long values[STAT_COUNT] = {};
+        for (int i = 0; i < RAID_STAT_SHARDS; i++){
+            for (int j = 0; j < STAT_COUNT; j++){
+                values[j] += m_Shards[i].m_Values[j].load(std::memory_order_relaxed);
+            }
+        }
+
+        TRaidStats stats;
+        for (int i = 0; i < MAX_RAID_DEVICES; i++){
+            stats.m_DriveReads[i] = values[STAT_DRIVE_READS + i];
+            stats.m_DriveReadSectors[i] = values[STAT_DRIVE_READ_SECTORS + i];
+            stats.m_DriveWrites[i] = values[STAT_DRIVE_WRITES + i];
+            stats.m_DriveWriteSectors[i] = values[STAT_DRIVE_WRITE_SECTORS + i];
+        }
+        stats.m_FullRows = values[STAT_FULL_ROWS];
+        stats.m_RmwRows = values[STAT_RMW_ROWS];
+        stats.m_ReconstructRows = values[STAT_RECONSTRUCT_ROWS];
+        stats.m_RecoverRows = values[STAT_RECOVER_ROWS];
+        stats.m_DegradedRows = values[STAT_DEGRADED_ROWS];
+        stats.m_ParityBytes = values[STAT_PARITY_BYTES];
+        stats.m_ResyncRows = values[STAT_RESYNC_ROWS];
+        return stats;
+    }
+
+private:
+    struct alignas(RAID_CACHE_LINE) TShard
+    {
+        std::atomic<long long>  m_Values[STAT_COUNT];
+    };
+
+    // Threads get shards round robin the first time they count anything
+    static int shard(void){
+        static std::atomic<int> next(0);
+        static thread_local int shard = next++ % RAID_STAT_SHARDS;
+        return shard;
+    }
+
+    TShard                  m_Shards[RAID_STAT_SHARDS];
+};
+
+//-------------------------------------------------------------------------------------------------
+// Latencies in log-linear buckets like HdrHistogram: values below 2^SUB_BITS have a bucket each,
+// every higher power of two is split into 2^SUB_BITS of them. Recording is one relaxed atomic add.
+class CLatencyHistogram
+{
+public:
+    CLatencyHistogram(){
+        for (int i = 0; i < BUCKETS; i++){
+            m_Counts[i] = 0;
+        }
+        m_Sum = 0;
+        m_Max = 0;
+    }
+
+    // Records count values of given nanoseconds each
+    void Record(long long value, long long count = 1){
+        m_Counts[bucket(value)].fetch_add(count, std::memory_order_relaxed);
+        m_Sum.fetch_add(value * count, std::memory_order_relaxed);
+        long long max = m_Max.load(std::memory_order_relaxed);
+        while (value > max && !m_Max.compare_exchange_weak(max, value, std::memory_order_relaxed)){
+        }
+    }
+
+    TRaidLatency Snapshot(void) const {
+        TRaidLatency latency = {};
+        long long counts[BUCKETS];
+        for (int i = 0; i < BUCKETS; i++){
+            counts[i] = m_Counts[i].load(std::memory_order_relaxed);
+            latency.m_Count += counts[i];
+        }
+        if (latency.m_Count == 0){
+            return latency;
+        }
+
+        latency.m_Mean = m_Sum.load(std::memory_order_relaxed) / latency.m_Count;
+        latency.m_Max = m_Max.load(std::memory_order_relaxed);
+        latency.m_P50 = min(percentile(counts, latency.m_Count, 0.5), latency.m_Max);
+        latency.m_P90 = min(percentile(counts, latency.m_Count, 0.9), latency.m_Max);
+        latency.m_P99 = min(percentile(counts, latency.m_Count, 0.99), latency.m_Max);
+        latency.m_P999 = min(percentile(counts, latency.m_Count, 0.999), latency.m_Max);
+        return latency;
+    }
+
+private:
+    static const int SUB = 1 << RAID_HISTOGRAM_SUB_BITS;
+    static const int BUCKETS = (64 - RAID_HISTOGRAM_SUB_BITS + 1) * SUB;
+
+    static int bucket(long long value){
+        if (value < SUB){
+            return value < 0 ? 0 : (int)value;
+        }
+        int shift = 63 - __builtin_clzll(value) - RAID_HISTOGRAM_SUB_BITS;
+        return (shift + 1) * SUB + (int)(value >> shift) - SUB;
+    }
+
+    // Highest value falling into the bucket
+    static long long bucketTop(int bucket){
+        if (bucket < SUB){
+            return bucket;
+        }
+        int shift = bucket / SUB - 1;
+        return ((long long)(bucket % SUB + SUB + 1) << shift) - 1;
+    }
+
+    static long long percentile(const long long *counts, long long total, double fraction){
+        long long rank = (long long)std::ceil(fraction * total);
+        long long seen = 0;
+        for (int i = 0; i < BUCKETS; i++){
+            seen += counts[i];
+            if (seen >= rank){
+                return bucketTop(i);
+            }
+        }
+        return bucketTop(BUCKETS - 1);
+    }
+
+    std::atomic<long long>  m_Counts[BUCKETS];
+    std::atomic<long long>  m_Sum;
+    std::atomic<long long>  m_Max;
+};
+
+// Histograms of all timed paths
+struct TLatencyHistograms
+{
+    CLatencyHistogram   m_Read;
+    CLatencyHistogram   m_Write;
+    CLatencyHistogram   m_ResyncRow;
+    CLatencyHistogram   m_DriveRead[MAX_RAID_DEVICES];
+    CLatencyHistogram   m_DriveWrite[MAX_RAID_DEVICES];
+};
+
+// Records time spent in the rest of the scope, spread over count values
+class CLatencyScope
+{
+public:
+    CLatencyScope(CLatencyHistogram &histogram, long long count = 1)
+        : m_Histogram(histogram), m_Count(count), m_Start(std::chrono::steady_clock::now()) {}
+    ~CLatencyScope(){
+        if (m_Count > 0){
+            long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_Start).count();
+            m_Histogram.Record(ns / m_Count, m_Count);
+        }
+    }
+
+private:
+    CLatencyHistogram                      &m_Histogram;
+    long long                               m_Count;
+    std::chrono::steady_clock::time_point   m_Start;
+};
+
+//-------------------------------------------------------------------------------------------------
+// Last RAID_TRACE_EVENTS requests and drive calls, dumped in the Chrome trace-event format.
+// Writers only take a slot with an atomic add, the dump expects no requests to be running.
+struct TTraceEvent
+{
+    const char        * m_Name;
+    // Nanoseconds since the tracer was made
+    long long           m_Start;
+    long long           m_Duration;
+    int                 m_Thread;
+    // Drive of a drive call, -1 for requests of the volume
+    int                 m_Drive;
+    int                 m_SecNr;
+    int                 m_SecCnt;
+};
+
+class CTracer
+{
+public:
+    CTracer() : m_Events(RAID_TRACE_EVENTS), m_Next(0), m_Epoch(std::chrono::steady_clock::now()) {}
+
+    long long Now(void) const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_Epoch).count();
+    }
+
+    void Add(const char *name, long long start, int drive, int secNr, int secCnt){
+        TTraceEvent &event = m_Events[m_Next.fetch_add(1, std::memory_order_relaxed) % RAID_TRACE_EVENTS];
+        event.m_Name = name;
+        event.m_Start = start;
+        event.m_Duration = Now() - start;
+        event.m_Thread = thread();
+        event.m_Drive = drive;
+        event.m_SecNr = secNr;
+        event.m_SecCnt = secCnt;
+    }
+
+    bool Dump(const char *fileName) const {
+        FILE *file = fopen(fileName, "w");
+        if (!file){
+            return false;
+        }
+
+        unsigned long long end = m_Next.load();
+        unsigned long long begin = end > (unsigned long long)RAID_TRACE_EVENTS ? end - RAID_TRACE_EVENTS : 0;
+        fprintf(file, "{\"traceEvents\":[");
+        for (unsigned long long i = begin; i < end; i++){
+            const TTraceEvent &event = m_Events[i % RAID_TRACE_EVENTS];
+            fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,"
+                          "\"args\":{\"drive\":%d,\"secNr\":%d,\"secCnt\":%d}}",
+                    i == begin ? "" : ",", event.m_Name, event.m_Drive < 0 ? "raid" : "drive",
+                    event.m_Start / 1000.0, event.m_Duration / 1000.0, event.m_Thread,
+                    event.m_Drive, event.m_SecNr, event.m_SecCnt);
+        }
+        fprintf(file, "\n],\"displayTimeUnit\":\"ns\"}\n");
+        return fclose(file) == 0;
+    }
+
+private:
+    // Threads are numbered in the trace in the order they first show up
+    static int thread(void){
+        static std::atomic<int> next(1);
+        static thread_local int thread = next++;
+        return thread;
+    }
+
+    std::vector<TTraceEvent>            m_Events;
+    std::atomic<unsigned long long>     m_Next;
+    std::chrono::steady_clock::time_point m_Epoch;
+};
+
+// Adds the rest of the scope to the trace
+class CTraceScope
+{
+public:
+    CTraceScope(CTracer &tracer, const char *name, int drive, int secNr, int secCnt)
+        : m_Tracer(tracer), m_Name(name), m_Drive(drive), m_SecNr(secNr), m_SecCnt(secCnt), m_Start(tracer.Now()) {}
+    ~CTraceScope(){
+        m_Tracer.Add(m_Name, m_Start, m_Drive, m_SecNr, m_SecCnt);
+    }
+
+private:
+    CTracer            &m_Tracer;
+    const char         *m_Name;
+    int                 m_Drive;
+    int                 m_SecNr;
+    int                 m_SecCnt;
+    long long           m_Start;
+};
+
+//-------------------------------------------------------------------------------------------------
+// Service data stored in the last sector of every drive
+struct TRaidService
+{
+    int                 m_Timestamp;
+    // Sectors a drive gets before the stripe moves on to the next drive, 0 on old volumes
+    int                 m_ChunkSectors;
+    // Resync checkpoint: rows below m_RebuildRow of m_RebuildDrive are already rebuilt.
+    // The drive being rebuilt carries the same m_RebuildId, so a drive swapped again is not trusted.
+    int                 m_RebuildDrive;
+    int                 m_RebuildRow;
+    int                 m_RebuildId;
+    // Resync only rebuilds regions marked in the bitmap
+    int                 m_RebuildDirty;
+    // Rows covered by one bit of the write-intent bitmap, 0 on volumes without bitmap
+    int                 m_BitmapRows;
+    // Timestamp the failed drive was left with, it missed only writes marked in the bitmap since then
+    int                 m_DegradedSince;
+    // Parity sectors in a row, 2 adds the Q syndrome, 0 on old volumes
+    int                 m_ParityDrives;
+    // Second drive rebuilt by the same Resync, dual parity only
+    int                 m_RebuildDrive2;
+};
+
+class CRaidVolume
+{
+public:
+    CRaidVolume();
+    ~CRaidVolume();
+    // Dual parity (parityDrives 2) survives two failed drives
+    static bool              Create                        ( const TBlkDev   & dev,
+                                                             int               chunkSectors = RAID_DEFAULT_CHUNK,
+                                                             int               parityDrives = 1 );
+    int                      Start                         ( const TBlkDev   & dev );
+    int                      Stop                          ( void );
+    int                      Resync                        ( void );
+    int                      Status                        ( void ) const;
+    int                      Size                          ( void ) const;
+    // Speed of the last finished Resync in MB/s
+    double                   ResyncRate                    ( void ) const;
+    // Rows kept in memory to serve reads and old data of partial writes, 0 turns caching off
+    void                     SetCacheSize                  ( int               rows );
+    long long                CacheHits                     ( void ) const;
+    long long                CacheMisses                   ( void ) const;
+    // Drive calls, write paths and parity work so far, counted without locks
+    TRaidStats               GetStats                      ( void ) const;
+    // Latency of a RAID_PATH_* so far, all zero unless built with RAID_LATENCY
+    TRaidLatency             GetLatency                    ( int               path,
+                                                             int               drive = 0 ) const;
+    // Writes recent requests and drive calls as Chrome trace-event JSON, false unless built
+    // with RAID_TRACE. Requests must not run meanwhile.
+    bool                     DumpTrace                     ( const char      * fileName ) const;
+    // Write only buffers data, a background thread writes it out, full rows without parity reads
+    void                     SetWriteBack                  ( bool              enable );
+    // Writes out everything buffered, false if the raid failed
+    bool                     Flush                         ( void );
+    // Device calls running on a drive at once from the next Start on, 1 for backends that
+    // can not take concurrent calls on a drive
+    void                     SetQueueDepth                 ( int               calls );
+    bool                     Read                          ( int               secNr,
+                                                             void            * data,
+                                                             int               secCnt );
+    bool                     Write                         ( int               secNr,
+                                                             const void      * data,
+                                                             int               secCnt );
+    // Like Read/Write, data of the sectors from secNr on go straight to or from the segments
+    bool                     Readv                         ( int               secNr,
+                                                             const TRaidSegment * segments,
+                                                             int               segCnt );
+    bool                     Writev                        ( int               secNr,
+                                                             const TRaidSegment * segments,
+                                                             int               segCnt );
+    // Return right away, done gets what Read/Write would return once the request finishes.
+    // It runs on a worker thread of the raid and must not call Stop. Stop waits for all requests.
+    void                     ReadAsync                     ( int               secNr,
+                                                             void            * data,
+                                                             int               secCnt,
+                                                             std::function<void(bool)> done );
+    void                     WriteAsync                    ( int               secNr,
+                                                             const void      * data,
+                                                             int               secCnt,
+                                                             std::function<void(bool)> done );
+protected:
+    // Status changes under stateMutex, requests only check it
+    std::atomic<int> raidStatus;
+    int raidServiceData;
+    // Failed drives in order, the second one only with dual parity, -1 if none
+    int raidFailedDrive;
+    int raidFailedDrive2;
+    int sectorNum;
+    int deviceNum;
+    int chunkSectors;
+    int parityNum;
+    int rowNum;
+    std::atomic<double> resyncRate;
+    // Rows of the failed drive below this one are rebuilt and used as healthy
+    std::atomic<int> rebuildRow;
+    int rebuildId;
+    bool rebuildDirty;
+    // Write-intent bitmap, a bit is set on disk before its rows are written and cleared lazily
+    int bitmapRows;
+    int bitmapWrites;
+    int degradedSince;
+    std::vector<unsigned char> bitmap;
+    std::vector<unsigned char> bitmapActive;
+    // Writes in progress per region, their regions stay dirty through a sweep
+    std::vector<int> bitmapWriters;
+    // Every change of the bits gets a new version, a region remembers the one that set its bit.
+    // The bitmap is written by one thread at a time with the mutex unlocked, bitmapWritten is
+    // the last version on disk.
+    std::vector<unsigned long long> bitmapSetVersions;
+    unsigned long long bitmapVersion;
+    unsigned long long bitmapWritten;
+    bool bitmapWriting;
+    // Async writes waiting for a version, see markDirtyAsync
+    std::vector<std::pair<unsigned long long, std::function<void(bool)> > > bitmapWaiters;
+    std::mutex bitmapMutex;
+    std::condition_variable bitmapCond;
+    // Failed drives, rebuild checkpoint and timestamps, together with the service sectors
+    // holding them. Resync runs one at a time.
+    std::recursive_mutex stateMutex;
+    std::mutex resyncMutex;
+    // Service sectors are numbered as they are filled, a drive never takes one over a newer one
+    unsigned long long serviceSeq;
+    unsigned long long serviceWritten[MAX_RAID_DEVICES];
+    std::mutex serviceMutex[MAX_RAID_DEVICES];
+    // Rows being read or written, see CStripeLocks
+    CStripeLocks stripeLocks;
+    CRaidCounters stats;
+#if defined(RAID_LATENCY)
+    std::unique_ptr<TLatencyHistograms> latency;
+#endif
+#if defined(RAID_TRACE)
+    CTracer tracer;
+#endif
+                            //( diskNr, secNr, data, secCnt )
+    int (*driveRead) ( int, int, void *, int );
+    int (*driveWrite) ( int, int, const void *, int );
+    // Runs device calls of requests on all drives at once
+    CDrivePool drivePool;
+    int queueDepth;
+    int cacheRows;
+    CStripeCache cache;
+    // Write-back buffer by row, a row only enters or leaves it under its stripe lock
+    std::atomic<bool> writeBack;
+    std::map<int, TDirtyRow> writeBuffer;
+    int fullRows;
+    int flushTick;
+    bool flusherStop;
+    std::thread flusher;
+    std::condition_variable flusherCond;
+    std::mutex bufferMutex;
+    // One flush at a time, Flush returns only after rows taken by the flusher are written too
+    std::mutex flushMutex;
+    // Async writes that found the buffer full, done once the flusher drained it
+    std::vector<std::function<void(bool)> > flushWaiters;
+    // Rows sequential readers will want, read by the drive threads in the background.
+    // Rows are read without their stripe locks, lock versions tell which ones were written since.
+    // The mutex only guards the stream table, nobody waits for a drive while holding it.
+    std::vector<TReadaheadStream> readaheadStreams;
+    unsigned readaheadTick;
+    // Windows of all streams, lookups skip the table while there are none
+    std::atomic<int> readaheadWindows;
+    std::mutex readaheadMutex;
+    // Steps of ReadAsync/WriteAsync requests, see TAsyncOp. Requests counts the ones not done yet.
+    std::deque<std::function<void()> > asyncQueue;
+    std::vector<std::thread> asyncWorkers;
+    int asyncRequests;
+    bool asyncStop;
+    std::mutex asyncMutex;
+    std::condition_variable asyncCond;
+    std::condition_variable asyncIdle;
+
+    bool WriteService(int driveID, int serviceData);
+    unsigned long long fillService(char *sector, int serviceData);
+    bool writeServiceSector(int drive, const char *sector, unsigned long long seq);
+    bool writeServices(void);
+    int failedDrives(void);
+    int rowFailedDrives(int row);
+    bool readBitmap(void);
+    bool writeBitmap(const unsigned char *sector);
+    bool syncBitmap(std::unique_lock<std::mutex> &lock, unsigned long long version);
+    void startBitmapWrite(std::unique_lock<std::mutex> &lock);
+    void bitmapWrote(std::unique_lock<std::mutex> &lock, unsigned long long written, bool ok);
+    unsigned long long setDirty(int firstRow, int lastRow);
+    bool markDirty(int firstRow, int lastRow);
+    void markDirtyAsync(int firstRow, int lastRow, std::function<void(bool)> done);
+    void doneDirty(int firstRow, int lastRow);
+    unsigned long long sweepBitmap(void);
+    bool regionDirty(int firstRow, int lastRow);
+    bool resyncParity(void);
+    int ReadService(int driveID, TRaidService *service = NULL);
+    void getRowRange(int secNr, int secCnt, int &firstRow, int &lastRow);
+    int lockWindow(int secNr, int secCnt);
+    template <typename F>
+    void forEachSector(TRowBatch &batch, int secNr, int secCnt, F callback);
+    int getPhysicalSector(int secNum);
+    int getPhysicalDrive(int secNum);
+    int getParityDrive(int row);
+    int getQDrive(int row);
+    int getParityDrives(int row);
+    int getDataDrive(int row, int chunk);
+    void encodeRows(TRowBatch &batch, int row, int count, int drives);
+    int recoverSources(int row, int lost);
+    void recoverRows(TRowBatch &batch, int row, int count, int lost);
+    void XORSectors(char* result, const char *sector, int count = 1);
+    void XORSources(char* result, const char **sources, int sourceCnt, int count = 1);
+    void GFSources(char* result, const char **sources, const unsigned char *coefs, int sourceCnt, size_t len);
+    // driveRead/driveWrite, counted in the stats
+    int readDrive(int drive, int secNr, void *data, int secCnt);
+    int writeDrive(int drive, int secNr, const void *data, int secCnt);
+    void cacheLookup(TRowBatch &batch, std::vector<char> &sectors);
+    void cacheStore(TRowBatch &batch, const std::vector<char> &sectors);
+    void updateReadahead(int secNr, int secCnt);
+    std::shared_ptr<CReadaheadWindow> startReadahead(int firstRow, int rows);
+    void readaheadLookup(TRowBatch &batch, std::vector<char> &sectors, bool wait);
+    void readaheadDrop(void);
+    bool readSectors(int secNr, const CSegmentCursor &data, int secCnt);
+    bool readWindow(int secNr, const CSegmentCursor &data, int secCnt);
+    bool writeSectors(int secNr, const CSegmentCursor &data, int secCnt);
+    bool writeWindow(int secNr, const CSegmentCursor &data, int secCnt);
+    bool readBatch(TRowBatch &batch, int secNr, const CSegmentCursor &data, int secCnt);
+    void planRead(TRowBatch &batch, int secNr, int secCnt, TBatchPlan &plan, bool wait);
+    void finishRead(TRowBatch &batch, int secNr, const CSegmentCursor &data, int secCnt, TBatchPlan &plan);
+    bool writeBatch(TRowBatch &batch, int secNr, const CSegmentCursor &data, int secCnt);
+    bool writeBatch(TRowBatch &batch, const std::vector<const char*> &newData);
+    void planWrite(TRowBatch &batch, const std::vector<const char*> &newData, TBatchPlan &plan);
+    void encodeWrite(TRowBatch &batch, const std::vector<const char*> &newData, TBatchPlan &plan);
+    bool writeRows(int secNr, const CSegmentCursor &data, int secCnt);
+    void bufferWrite(int secNr, const CSegmentCursor &data, int secCnt);
+    void bufferRead(int secNr, const CSegmentCursor &data, int secCnt);
+    void bufferDiscard(int secNr, int secCnt);
+    bool flushBuffer(bool all);
+    void startFlusher(void);
+    void stopFlusher(void);
+    void flusherLoop(void);
+    void submitAsync(std::shared_ptr<TAsyncOp> op);
+    void postAsync(std::function<void()> step);
+    void startAsync(void);
+    void stopAsync(void);
+    void asyncLoop(void);
+    void asyncStart(const std::shared_ptr<TAsyncOp> &op);
+    void asyncLock(const std::shared_ptr<TAsyncOp> &op);
+    void asyncRead(const std::shared_ptr<TAsyncOp> &op);
+    void asyncWrite(const std::shared_ptr<TAsyncOp> &op);
+    void asyncWriteBatch(const std::shared_ptr<TAsyncOp> &op);
+    void asyncFinish(const std::shared_ptr<TAsyncOp> &op, bool ok);
+    int batchDrives(TRowBatch &batch, const std::vector<char> &sectors);
+    bool driveRuns(TRowBatch &batch, const std::vector<char> &sectors, bool write, int drive);
+    int batchIO(TRowBatch &batch, const std::vector<char> &sectors, bool write);
+    void batchIOAsync(TRowBatch &batch, const std::vector<char> &sectors, bool write, std::function<void(int)> done);
+    bool failDrives(int mask);
+};
+
+int CRaidVolume::Start(const TBlkDev &dev) {
+
+    sectorNum = dev.m_Sectors;
+    deviceNum = dev.m_Devices;
+    driveWrite = dev.m_Write;
+    driveRead = dev.m_Read;
+    drivePool.Start(deviceNum, queueDepth);
+    for (int i = 0; i < MAX_RAID_DEVICES; i++){
+        serviceWritten[i] = 0;
+    }
+
+    raidFailedDrive = -1;
+    raidFailedDrive2 = -1;
+    raidStatus = RAID_OK;
+    rebuildRow = 0;
+    rebuildId = 0;
+    rebuildDirty = false;
+
+    int timestamps[MAX_RAID_DEVICES];
+    TRaidService services[MAX_RAID_DEVICES];
+    memset(services, 0, sizeof(services));
+
+    // Go through drives and read timestamps
+    for (int i = 0; i < deviceNum; i++){
+        timestamps[i] = ReadService(i, &services[i]);
+    }
+
+    // Timestamp of most drives wins, the newer one on a tie. Drives without it missed some writes.
+    int timestamp = 0;
+    int votes = 0;
+    int inSync = -1;
+    for (int i = 0; i < deviceNum; i++){
+        // Drive failed read or does not belong to the raid
+        if (timestamps[i] < 42){
+            continue;
+        }
+        int count = (int)std::count(timestamps, timestamps + deviceNum, timestamps[i]);
+        if (count > votes || (count == votes && timestamps[i] > timestamp)){
+            timestamp = timestamps[i];
+            votes = count;
+            inSync = i;
+        }
+    }
+    if (inSync < 0){
+        raidStatus = RAID_FAILED;
+        return raidStatus;
+    }
+    raidServiceData = timestamp;
+
+    // Layout is taken from a drive that is in sync, old volumes striped by single sectors
+    const TRaidService &service = services[inSync];
+    parityNum = service.m_ParityDrives == 0 ? 1 : service.m_ParityDrives;
+    if (parityNum > 2 || deviceNum < parityNum + 2 || deviceNum - votes > parityNum){
+        raidStatus = RAID_FAILED;
+        return raidStatus;
+    }
+    for (int i = 0; i < deviceNum; i++){
+        if (timestamps[i] != timestamp){
+            raidStatus = RAID_DEGRADED;
+            if (raidFailedDrive < 0){
+                raidFailedDrive = i;
+            } else {
+                raidFailedDrive2 = i;
+            }
+        }
+    }
+
+    chunkSectors = service.m_ChunkSectors;
+    if (chunkSectors == 0){
+        chunkSectors = 1;
+    }
+    // Volumes with a bitmap keep it in the sector before the service one
+    bitmapRows = service.m_BitmapRows;
+    int reserved = bitmapRows > 0 ? 2 : 1;
+    if (chunkSectors < 0 || chunkSectors > sectorNum-reserved || bitmapRows < 0){
+        raidStatus = RAID_FAILED;
+        return raidStatus;
+    }
+    // Rows after the last whole chunk are not used
+    rowNum = (sectorNum-reserved) / chunkSectors * chunkSectors;
+    stripeLocks.Init(chunkSectors);
+    cache.Init(deviceNum, cacheRows, chunkSectors);
+    degradedSince = raidStatus == RAID_DEGRADED ? service.m_DegradedSince : 0;
+
+    // Resync of the failed drives was interrupted, it goes on from the checkpoint
+    if (raidStatus == RAID_DEGRADED && service.m_RebuildRow > 0 && service.m_RebuildId != 0
+        && service.m_RebuildDrive == raidFailedDrive && service.m_RebuildDrive2 == raidFailedDrive2
+        && services[raidFailedDrive].m_RebuildId == service.m_RebuildId
+        && (raidFailedDrive2 < 0 || services[raidFailedDrive2].m_RebuildId == service.m_RebuildId)){
+        rebuildRow = min(service.m_RebuildRow, rowNum);
+        rebuildId = service.m_RebuildId;
+        rebuildDirty = service.m_RebuildDirty != 0;
+    }
+
+    if (bitmapRows > 0 && readBitmap()){
+        // Raid was not stopped cleanly, parity of rows written at that time may be stale
+        if (raidStatus == RAID_OK && regionDirty(0, rowNum-1)){
+            resyncParity();
+        }
+    }
+
+    fullRows = 0;
+    flushTick = 0;
+    readaheadStreams.assign(RAID_READAHEAD_STREAMS, TReadaheadStream());
+    readaheadTick = 0;
+    if (writeBack){
+        startFlusher();
+    }
+    startAsync();
+
+    return raidStatus;
+}
+
+int CRaidVolume::Stop(void) {
+
+    // Requests already submitted finish first, then buffered writes reach the drives
+    // before the timestamp says the raid was stopped
+    stopAsync();
+    stopFlusher();
+    if (raidStatus == RAID_OK || raidStatus == RAID_DEGRADED){
+        flushBuffer(true);
+    }
+    writeBuffer.clear();
+    readaheadDrop();
+
+    // Raid in sync is stopped cleanly, no region needs parity resync on next start
+    if (raidStatus == RAID_OK && bitmapRows > 0){
+        std::unique_lock<std::mutex> lock(bitmapMutex);
+        std::fill(bitmapActive.begin(), bitmapActive.end(), 0);
+        syncBitmap(lock, sweepBitmap());
+    }
+
+    std::unique_lock<std::recursive_mutex> lock(stateMutex);
+    raidServiceData++;
+
+    if (raidStatus == RAID_FAILED){
+        lock.unlock();
+        drivePool.Stop();
+        cache.Clear();
+        raidStatus = RAID_STOPPED;
+        return raidStatus;
+    }
+
+    for (int i = 0; i < deviceNum; i++){
+        if (failedDrives() & (1 << i)){ continue; }
+        WriteService(i, raidServiceData);
+    }
+    lock.unlock();
+
+    drivePool.Stop();
+    cache.Clear();
+    raidStatus = RAID_STOPPED;
+    return raidStatus;
+}
+
+bool CRaidVolume::Read(int secNr, void *data, int secCnt) {
+    TRaidSegment segment = { data, secCnt };
+    return Readv(secNr, &segment, 1);
+}
+
+bool CRaidVolume::Readv(int secNr, const TRaidSegment *segments, int segCnt) {
+
+    CSegmentCursor data(segments, segCnt);
+    int secCnt = data.Count();
+    RAID_LATENCY_SCOPE(latency->m_Read, 1);
+    RAID_TRACE_SCOPE("Read", -1, secNr, secCnt);
+
+    if ((raidStatus != RAID_OK && raidStatus != RAID_DEGRADED) || secNr < 0 || secCnt < 0 || secCnt > Size() - secNr){
+        return false;
+    }
+    if (secCnt == 0){
+        return true;
+    }
+    return readSectors(secNr, data, secCnt);
+}
+
+bool CRaidVolume::readSectors(int secNr, const CSegmentCursor &data, int secCnt) {
+    for (int done = 0, count; done < secCnt; done += count){
+        count = lockWindow(secNr + done, secCnt - done);
+        if (!readWindow(secNr + done, CSegmentCursor(data, done), count)){
+            return false;
+        }
+    }
+    updateReadahead(secNr, secCnt);
+    return true;
+}
+
+bool CRaidVolume::readWindow(int secNr, const CSegmentCursor &data, int secCnt) {
+
+    int firstRow, lastRow;
+    getRowRange(secNr, secCnt, firstRow, lastRow);
+    CStripeGuard guard(stripeLocks, stripeLocks.Rows(firstRow, lastRow), CStripeLocks::LOCK_SHARED);
+
+    // Rows are processed in batches so that every drive gets as few calls as possible
+    TRowBatch batch;
+    for (int row = firstRow, count; row <= lastRow; row += count){
+        // Batch does not cross the rebuild checkpoint, failed drive is the same for all its rows
+        count = min(RAID_BATCH_ROWS, lastRow - row + 1);
+        if (row < rebuildRow){
+            count = min(count, rebuildRow - row);
+        }
+
+        batch.Init(deviceNum, row, count);
+        if (!readBatch(batch, secNr, data, secCnt)){
+            return false;
+        }
+    }
+
+    // Data still in the write-back buffer is newer than the drives
+    bufferRead(secNr, data, secCnt);
+    return true;
+}
+
+// Fills the batch with cached sectors and unmarks them, so they are not read
+void CRaidVolume::cacheLookup(TRowBatch &batch, std::vector<char> &sectors) {
+    int rows = batch.m_Rows;
+    for (int drive = 0; drive < deviceNum; drive++){
+        for (int i = 0; i < rows; i++){
+            int row = batch.m_FirstRow + i;
+            if (sectors[drive * rows + i] && cache.Get(row, drive, batch.Sector(drive, row))){
+                sectors[drive * rows + i] = 0;
+            }
+        }
+    }
+}
+
+void CRaidVolume::cacheStore(TRowBatch &batch, const std::vector<char> &sectors) {
+    int rows = batch.m_Rows;
+    for (int drive = 0; drive < deviceNum; drive++){
+        for (int i = 0; i < rows; i++){
+            int row = batch.m_FirstRow + i;
+            if (sectors[drive * rows + i]){
+                cache.Put(row, drive, batch.Sector(drive, row));
+            }
+        }
+    }
+}
+
+// A Read continuing a stream grows its window, any other Read replaces the least recently used stream.
+// A continuing Read outside of the windows of its stream halves the window instead.
+// The window holding the next sector is prefetched, and the one after it once the reader is halfway.
+void CRaidVolume::updateReadahead(int secNr, int secCnt) {
+    int firstRow, lastRow;
+    getRowRange(secNr, secCnt, firstRow, lastRow);
+    // Rows of data the Read consumed, the window is at most RAID_READAHEAD_REQUESTS of them
+    int consumed = (secCnt + deviceNum - parityNum - 1) / (deviceNum - parityNum);
+    int limit = min(RAID_READAHEAD_MAX, consumed * RAID_READAHEAD_REQUESTS);
+
+    std::lock_guard<std::mutex> lock(readaheadMutex);
+    TReadaheadStream *stream = NULL;
+    for (TReadaheadStream &candidate : readaheadStreams){
+        if (candidate.m_Next == secNr){
+            stream = &candidate;
+            break;
+        }
+    }
+    if (stream){
+        const CReadaheadWindow *current = stream->m_Current.get(), *ahead = stream->m_Ahead.get();
+        int endRow = current ? (ahead && ahead->FirstRow() == current->EndRow() ? ahead->EndRow() : current->EndRow()) : 0;
+        if (current && (firstRow < current->FirstRow() || lastRow >= endRow)){
+            stream->m_Window /= 2;
+        } else {
+            stream->m_Window = min(stream->m_Window + consumed, limit);
+        }
+    } else {
+        stream = &*std::min_element(readaheadStreams.begin(), readaheadStreams.end(),
+                                    [](const TReadaheadStream &a, const TReadaheadStream &b){ return a.m_Tick < b.m_Tick; });
+        *stream = TReadaheadStream();
+    }
+    stream->m_Next = secNr + secCnt;
+    stream->m_Tick = ++readaheadTick;
+
+    if (stream->m_Window > 0 && stream->m_Next < Size()){
+        int row = getPhysicalSector(stream->m_Next);
+        int rows = (stream->m_Window + chunkSectors - 1) / chunkSectors * chunkSectors;
+        if (stream->m_Ahead && row >= stream->m_Ahead->FirstRow() && row < stream->m_Ahead->EndRow()){
+            stream->m_Current = std::move(stream->m_Ahead);
+        }
+        if (!stream->m_Current || row < stream->m_Current->FirstRow() || row >= stream->m_Current->EndRow()){
+            stream->m_Ahead.reset();
+            stream->m_Current = startReadahead(row / chunkSectors * chunkSectors, rows);
+        }
+        const CReadaheadWindow *current = stream->m_Current.get();
+        if (current && !stream->m_Ahead && row >= current->FirstRow() + current->m_Batch.m_Rows / 2 && current->EndRow() < rowNum){
+            stream->m_Ahead = startReadahead(current->EndRow(), rows);
+        }
+    }
+
+    int windows = 0;
+    for (const TReadaheadStream &candidate : readaheadStreams){
+        windows += (candidate.m_Current != NULL) + (candidate.m_Ahead != NULL);
+    }
+    readaheadWindows = windows;
+}
+
+// Queues reads of the window on the drive threads, the window does not cross the rebuild checkpoint
+std::shared_ptr<CReadaheadWindow> CRaidVolume::startReadahead(int firstRow, int rows) {
+    rows = min(rows, rowNum - firstRow);
+    if (firstRow < rebuildRow){
+        rows = min(rows, rebuildRow - firstRow);
+    }
+    if (rows <= 0){
+        return NULL;
+    }
+
+    std::shared_ptr<CReadaheadWindow> window(new CReadaheadWindow(deviceNum, firstRow, rows, rowFailedDrives(firstRow)));
+    window->m_Versions.resize(RAID_STRIPE_LOCKS);
+    for (int i = 0; i < RAID_STRIPE_LOCKS; i++){
+        window->m_Versions[i] = stripeLocks.Version(i);
+    }
+
+    for (int piece = 0; piece < window->m_Pieces; piece++){
+        int row = firstRow + piece * RAID_BATCH_ROWS;
+        int count = min(RAID_BATCH_ROWS, firstRow + rows - row);
+        for (int i = 0; i < deviceNum; i++){
+            if (window->m_Lost & (1 << i)){
+                continue;
+            }
+            drivePool.Submit(i, [this, window, i, piece, row, count]{
+                window->Done(i, piece, readDrive(i, row, window->m_Batch.Sector(i, row), count) == count);
+            });
+        }
+    }
+    return window;
+}
+
+// Fills the batch with prefetched sectors and unmarks them, a failed prefetch is left to the normal reads.
+// So are rows written since the prefetch started, and without waiting pieces not read yet.
+void CRaidVolume::readaheadLookup(TRowBatch &batch, std::vector<char> &sectors, bool wait) {
+    if (readaheadWindows == 0){
+        return;
+    }
+    int rows = batch.m_Rows;
+    std::vector<std::shared_ptr<CReadaheadWindow> > windows;
+    {
+        std::lock_guard<std::mutex> lock(readaheadMutex);
+        for (const TReadaheadStream &stream : readaheadStreams){
+            for (const std::shared_ptr<CReadaheadWindow> &window : { stream.m_Current, stream.m_Ahead }){
+                if (window && window->FirstRow() < batch.m_FirstRow + rows && window->EndRow() > batch.m_FirstRow){
+                    windows.push_back(window);
+                }
+            }
+        }
+    }
+
+    for (const std::shared_ptr<CReadaheadWindow> &window : windows){
+        int first = max(batch.m_FirstRow, window->FirstRow());
+        int last = min(batch.m_FirstRow + rows, window->EndRow());
+        for (int drive = 0; drive < deviceNum; drive++){
+            if (window->m_Lost & (1 << drive)){
+                continue;
+            }
+            for (int from = first, to; from < last; from = to){
+                int piece = window->Piece(from);
+                to = min(last, window->FirstRow() + (piece + 1) * RAID_BATCH_ROWS);
+
+                // Pieces without a wanted sector are not waited for
+                char *marked = &sectors[drive * rows + from - batch.m_FirstRow];
+                if (std::find(marked, marked + to - from, 1) == marked + to - from
+                    || !(wait ? window->Wait(drive, piece) : window->Arrived(drive, piece))){
+                    continue;
+                }
+                for (int row = from; row < to; row++){
+                    int stripeLock = stripeLocks.Lock(row);
+                    if (marked[row - from] && stripeLocks.Version(stripeLock) == window->m_Versions[stripeLock]){
+                        memcpy(batch.Sector(drive, row), window->m_Batch.Sector(drive, row), SECTOR_SIZE);
+                        marked[row - from] = 0;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Forgets all streams once the drives are done with their windows
+void CRaidVolume::readaheadDrop(void) {
+    std::vector<TReadaheadStream> streams;
+    {
+        std::lock_guard<std::mutex> lock(readaheadMutex);
+        streams.swap(readaheadStreams);
+        readaheadStreams.assign(streams.size(), TReadaheadStream());
+        readaheadWindows = 0;
+    }
+    for (const TReadaheadStream &stream : streams){
+        if (stream.m_Current){
+            stream.m_Current->WaitAll();
+        }
+        if (stream.m_Ahead){
+            stream.m_Ahead->WaitAll();
+        }
+    }
+}
+
+bool CRaidVolume::readBatch(TRowBatch &batch, int secNr, const CSegmentCursor &data, int secCnt) {
+
+    TBatchPlan plan;
+    while (true){
+        planRead(batch, secNr, secCnt, plan, true);
+        int failed = batchIO(batch, plan.m_Sectors, false);
+        if (!failed){
+            break;
+        }
+        // If read fails turns drive to degraded and tries again
+        if (!failDrives(failed)){
+            return false;
+        }
+    }
+
+    finishRead(batch, secNr, data, secCnt, plan);
+    return true;
+}
+
+// Marks the sectors of the batch the drives have to read, the rest comes from the cache and
+// readahead. Without waiting, prefetched sectors still on their way are read again.
+void CRaidVolume::planRead(TRowBatch &batch, int secNr, int secCnt, TBatchPlan &plan, bool wait) {
+
+    int rows = batch.m_Rows;
+    std::vector<char> &sectors = plan.m_Sectors;
+
+    // Marking which sectors of the batch are requested
+    sectors.assign(deviceNum * rows, 0);
+    forEachSector(batch, secNr, secCnt, [&](int /*currentSector*/, int physDrive, int physSector){
+        sectors[physDrive * rows + physSector - batch.m_FirstRow] = 1;
+    });
+    cacheLookup(batch, sectors);
+    readaheadLookup(batch, sectors, wait);
+
+    // Sectors of the failed drives are not read but calculated afterwards
+    int lost = plan.m_Lost = rowFailedDrives(batch.m_FirstRow);
+    plan.m_LostSectors.assign(deviceNum * rows, 0);
+    plan.m_Degraded.assign(rows, 0);
+    for (int drive = 0; drive < deviceNum; drive++){
+        if (!(lost & (1 << drive))){
+            continue;
+        }
+        for (int i = 0; i < rows; i++){
+            if (sectors[drive * rows + i]){
+                plan.m_LostSectors[drive * rows + i] = 1;
+                sectors[drive * rows + i] = 0;
+                plan.m_Degraded[i] = 1;
+            }
+        }
+    }
+
+    // Rows with a lost sector are read whole, together with the requested sectors
+    std::vector<char> rest(deviceNum * rows, 0);
+    for (int i = 0; i < rows; i++){
+        if (!plan.m_Degraded[i]){
+            continue;
+        }
+        int drives = recoverSources(batch.m_FirstRow + i, lost);
+        for (int drive = 0; drive < deviceNum; drive++){
+            if ((drives & (1 << drive)) && !sectors[drive * rows + i]){
+                rest[drive * rows + i] = 1;
+            }
+        }
+    }
+    cacheLookup(batch, rest);
+    readaheadLookup(batch, rest, wait);
+    for (int i = 0; i < deviceNum * rows; i++){
+        sectors[i] |= rest[i];
+    }
+}
+
+// Recovers lost sectors of the read batch and copies the requested ones to the caller
+void CRaidVolume::finishRead(TRowBatch &batch, int secNr, const CSegmentCursor &data, int secCnt, TBatchPlan &plan) {
+
+    int rows = batch.m_Rows;
+
+    // Lost sectors are recovered from the rest of their rows, runs of rows at once
+    for (int i = 0; i < rows; i++){
+        if (!plan.m_Degraded[i]){
+            continue;
+        }
+        int count = 1;
+        while (i + count < rows && plan.m_Degraded[i + count]){
+            count++;
+        }
+        recoverRows(batch, batch.m_FirstRow + i, count, plan.m_Lost);
+        stats.Add(STAT_DEGRADED_ROWS, count);
+        i += count;
+    }
+
+    cacheStore(batch, plan.m_Sectors);
+    cacheStore(batch, plan.m_LostSectors);
+
+    // Copying requested sectors to the caller
+    forEachSector(batch, secNr, secCnt, [&](int currentSector, int physDrive, int physSector){
+        memcpy(data[currentSector - secNr], batch.Sector(physDrive, physSector), SECTOR_SIZE);
+    });
+}
+
+bool CRaidVolume::Write(int secNr, const void *data, int secCnt) {
+    TRaidSegment segment = { (void*)data, secCnt };
+    return Writev(secNr, &segment, 1);
+}
+
+bool CRaidVolume::Writev(int secNr, const TRaidSegment *segments, int segCnt) {
+
+    CSegmentCursor data(segments, segCnt);
+    int secCnt = data.Count();
+    RAID_LATENCY_SCOPE(latency->m_Write, 1);
+    RAID_TRACE_SCOPE("Write", -1, secNr, secCnt);
+
+    if ((raidStatus != RAID_OK && raidStatus != RAID_DEGRADED) || secNr < 0 || secCnt < 0 || secCnt > Size() - secNr){
+        return false;
+    }
+    if (secCnt == 0){
+        return true;
+    }
+    return writeSectors(secNr, data, secCnt);
+}
+
+bool CRaidVolume::writeSectors(int secNr, const CSegmentCursor &data, int secCnt) {
+    for (int done = 0, count; done < secCnt; done += count){
+        count = lockWindow(secNr + done, secCnt - done);
+        if (!writeWindow(secNr + done, CSegmentCursor(data, done), count)){
+            return false;
+        }
+    }
+    return true;
+}
+
+bool CRaidVolume::writeWindow(int secNr, const CSegmentCursor &data, int secCnt) {
+
+    int firstRow, lastRow;
+    getRowRange(secNr, secCnt, firstRow, lastRow);
+
+    bool full;
+    {
+        CStripeGuard guard(stripeLocks, stripeLocks.Rows(firstRow, lastRow), CStripeLocks::LOCK_WRITE);
+        if (!writeBack){
+            // Older data of the sectors left in the buffer must not be flushed over the new one
+            bufferDiscard(secNr, secCnt);
+            return writeRows(secNr, data, secCnt);
+        }
+
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        bufferWrite(secNr, data, secCnt);
+        full = (int)writeBuffer.size() >= RAID_WRITEBACK_ROWS;
+        if (!full && fullRows >= RAID_BATCH_ROWS){
+            flusherCond.notify_one();
+        }
+    }
+
+    // Buffer is full, the caller waits for it to drain once its own rows are unlocked
+    return !full || flushBuffer(true);
+}
+
+bool CRaidVolume::writeRows(int secNr, const CSegmentCursor &data, int secCnt) {
+
+    int firstRow, lastRow;
+    getRowRange(secNr, secCnt, firstRow, lastRow);
+
+    // Rows are marked in the bitmap before they are written
+    bool ok = markDirty(firstRow, lastRow);
+
+    TRowBatch batch;
+    for (int row = firstRow, count; ok && row <= lastRow; row += count){
+        count = min(RAID_BATCH_ROWS, lastRow - row + 1);
+        if (row < rebuildRow){
+            count = min(count, rebuildRow - row);
+        }
+
+        batch.Init(deviceNum, row, count);
+        ok = writeBatch(batch, secNr, data, secCnt);
+    }
+
+    doneDirty(firstRow, lastRow);
+    return ok;
+}
+
+void CRaidVolume::bufferWrite(int secNr, const CSegmentCursor &data, int secCnt) {
+    for (int i = 0; i < secCnt; i++){
+        int row = getPhysicalSector(secNr + i);
+        int drive = getPhysicalDrive(secNr + i);
+
+        auto it = writeBuffer.find(row);
+        if (it == writeBuffer.end()){
+            TDirtyRow &entry = writeBuffer[row];
+            entry.m_Tick = flushTick;
+            entry.m_Sectors = 0;
+            entry.m_Mask = 0;
+            entry.m_Data.resize((size_t)deviceNum * SECTOR_SIZE);
+            it = writeBuffer.find(row);
+        }
+
+        TDirtyRow &entry = it->second;
+        memcpy(&entry.m_Data[(size_t)drive * SECTOR_SIZE], data[i], SECTOR_SIZE);
+        if (!(entry.m_Mask & (1 << drive))){
+            entry.m_Mask |= 1 << drive;
+            if (++entry.m_Sectors == deviceNum-parityNum){
+                fullRows++;
+            }
+        }
+    }
+}
+
+void CRaidVolume::bufferRead(int secNr, const CSegmentCursor &data, int secCnt) {
+    std::lock_guard<std::mutex> lock(bufferMutex);
+    if (writeBuffer.empty()){
+        return;
+    }
+    for (int i = 0; i < secCnt; i++){
+        int drive = getPhysicalDrive(secNr + i);
+        auto it = writeBuffer.find(getPhysicalSector(secNr + i));
+        if (it != writeBuffer.end() && (it->second.m_Mask & (1 << drive))){
+            memcpy(data[i], &it->second.m_Data[(size_t)drive * SECTOR_SIZE], SECTOR_SIZE);
+        }
+    }
+}
+
+void CRaidVolume::bufferDiscard(int secNr, int secCnt) {
+    std::lock_guard<std::mutex> lock(bufferMutex);
+    for (int i = 0; i < secCnt && !writeBuffer.empty(); i++){
+        int drive = getPhysicalDrive(secNr + i);
+        auto it = writeBuffer.find(getPhysicalSector(secNr + i));
+        if (it == writeBuffer.end() || !(it->second.m_Mask & (1 << drive))){
+            continue;
+        }
+        if (it->second.m_Sectors-- == deviceNum-parityNum){
+            fullRows--;
+        }
+        it->second.m_Mask &= ~(1 << drive);
+        if (!it->second.m_Mask){
+            writeBuffer.erase(it);
+        }
+    }
+}
+
+// Writes out full rows, or all of them, and rows buffered before the previous flusher wake-up
+bool CRaidVolume::flushBuffer(bool all) {
+
+    std::lock_guard<std::mutex> flushLock(flushMutex);
+    std::vector<int> picked;
+    TStripeSet locks;
+    {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        for (auto it = writeBuffer.begin(); it != writeBuffer.end(); ++it){
+            if (all || it->second.m_Sectors == deviceNum-parityNum || it->second.m_Tick < flushTick){
+                picked.push_back(it->first);
+                locks.set(stripeLocks.Lock(it->first));
+            }
+        }
+    }
+    if (picked.empty()){
+        return raidStatus != RAID_FAILED;
+    }
+
+    // Rows leave the buffer under their locks, so a reader finds them either there or on the drives
+    CStripeGuard guard(stripeLocks, locks, CStripeLocks::LOCK_WRITE);
+    std::map<int, TDirtyRow> rows;
+    {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        for (int row : picked){
+            auto it = writeBuffer.find(row);
+            if (it == writeBuffer.end()){
+                continue;
+            }
+            if (it->second.m_Sectors == deviceNum-parityNum){
+                fullRows--;
+            }
+            rows[row] = std::move(it->second);
+            writeBuffer.erase(it);
+        }
+    }
+
+    // Buffered rows close to each other go out in one batch, rows between them are left alone
+    TRowBatch batch;
+    std::vector<const char*> newData;
+    for (auto it = rows.begin(); it != rows.end(); ){
+        if (raidStatus != RAID_OK && raidStatus != RAID_DEGRADED){
+            return false;
+        }
+
+        int firstRow = it->first;
+        int endRow = min(firstRow + RAID_BATCH_ROWS, rowNum);
+        if (firstRow < rebuildRow){
+            endRow = min(endRow, (int)rebuildRow);
+        }
+        auto end = rows.lower_bound(endRow);
+        int lastRow = std::prev(end)->first;
+
+        int count = lastRow - firstRow + 1;
+        batch.Init(deviceNum, firstRow, count);
+        newData.assign((size_t)deviceNum * count, NULL);
+        for (; it != end; ++it){
+            for (int drive = 0; drive < deviceNum; drive++){
+                if (it->second.m_Mask & (1 << drive)){
+                    newData[drive * count + it->first - firstRow] = &it->second.m_Data[(size_t)drive * SECTOR_SIZE];
+                }
+            }
+        }
+
+        bool ok = markDirty(firstRow, lastRow) && writeBatch(batch, newData);
+        doneDirty(firstRow, lastRow);
+        if (!ok){
+            return false;
+        }
+    }
+
+    return raidStatus != RAID_FAILED;
+}
+
+void CRaidVolume::startFlusher(void) {
+    flusherStop = false;
+    flusher = std::thread(&CRaidVolume::flusherLoop, this);
+}
+
+void CRaidVolume::stopFlusher(void) {
+    if (!flusher.joinable()){
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        flusherStop = true;
+    }
+    flusherCond.notify_one();
+    flusher.join();
+
+    // Async writes the flusher did not get to wait for this flush
+    std::vector<std::function<void(bool)> > waiters;
+    {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        waiters.swap(flushWaiters);
+    }
+    if (!waiters.empty()){
+        bool ok = flushBuffer(true);
+        for (std::function<void(bool)> &waiter : waiters){
+            postAsync(std::bind(waiter, ok));
+        }
+    }
+}
+
+void CRaidVolume::ReadAsync(int secNr, void *data, int secCnt, std::function<void(bool)> done) {
+    submitAsync(std::make_shared<TAsyncOp>(false, secNr, data, secCnt, std::move(done)));
+}
+
+void CRaidVolume::WriteAsync(int secNr, const void *data, int secCnt, std::function<void(bool)> done) {
+    submitAsync(std::make_shared<TAsyncOp>(true, secNr, (void*)data, secCnt, std::move(done)));
+}
+
+void CRaidVolume::submitAsync(std::shared_ptr<TAsyncOp> op) {
+#if defined(RAID_LATENCY)
+    op->m_Started = std::chrono::steady_clock::now();
+#endif
+    {
+        std::lock_guard<std::mutex> lock(asyncMutex);
+        if (!asyncWorkers.empty() && !asyncStop){
+            asyncRequests++;
+            asyncQueue.push_back([this, op]{ asyncStart(op); });
+            asyncCond.notify_one();
+            return;
+        }
+    }
+    // Raid is not running, the request fails like Read/Write would
+    op->m_Done(false);
+}
+
+// Queues the next step of a request
+void CRaidVolume::postAsync(std::function<void()> step) {
+    std::lock_guard<std::mutex> lock(asyncMutex);
+    asyncQueue.push_back(std::move(step));
+    asyncCond.notify_one();
+}
+
+void CRaidVolume::startAsync(void) {
+    asyncStop = false;
+    for (int i = 0; i < RAID_ASYNC_THREADS; i++){
+        asyncWorkers.emplace_back(&CRaidVolume::asyncLoop, this);
+    }
+}
 
-    bool WriteService(int driveID, int serviceData);
-    int ReadService(int driveID);
-    int getPhysicalSector(int secNum);
-    int getPhysicalDrive(int secNum);
-    int getParityDrive(int row);
-    void XORSectors(char* result, const char *sector);
-    bool calculateDegradedSector(char *result, int degDrive, int row);
-};
+void CRaidVolume::stopAsync(void) {
+    {
+        // Requests still running post more steps, workers stay until the last one is done
+        std::unique_lock<std::mutex> lock(asyncMutex);
+        asyncIdle.wait(lock, [this]{ return asyncRequests == 0; });
+        asyncStop = true;
+    }
+    asyncCond.notify_all();
+    for (std::thread &worker : asyncWorkers){
+        worker.join();
+    }
 
-int CRaidVolume::Start(const TBlkDev &dev) {
+    std::lock_guard<std::mutex> lock(asyncMutex);
+    asyncWorkers.clear();
+}
 
-    sectorNum = dev.m_Sectors;
-    deviceNum = dev.m_Devices;
-    driveWrite = dev.m_Write;
-    driveRead = dev.m_Read;
+void CRaidVolume::asyncLoop(void) {
+    std::unique_lock<std::mutex> lock(asyncMutex);
+    while (true){
+        asyncCond.wait(lock, [this]{ return asyncStop || !asyncQueue.empty(); });
+        if (asyncQueue.empty()){
+            return;
+        }
 
-    raidFailedDrive = -1;
-    raidStatus = RAID_OK;
-    int zeroCnt = 0;
+        std::function<void()> step = std::move(asyncQueue.front());
+        asyncQueue.pop_front();
+        lock.unlock();
+        step();
+        lock.lock();
+    }
+}
 
-    int timestamps[MAX_RAID_DEVICES];
+// Checks the request like Read/Write do and waits for its stripe locks
+void CRaidVolume::asyncStart(const std::shared_ptr<TAsyncOp> &op) {
+    if ((raidStatus != RAID_OK && raidStatus != RAID_DEGRADED) || op->m_SecNr < 0 || op->m_SecCnt < 0
+        || op->m_SecCnt > Size() - op->m_SecNr){
+        asyncFinish(op, false);
+        return;
+    }
+    if (op->m_SecCnt == 0){
+        asyncFinish(op, true);
+        return;
+    }
+    op->m_SecCnt = lockWindow(op->m_SecNr, op->m_RequestCnt);
+    asyncLock(op);
+}
 
-    // Go through drives and read timestamps
+// Waits for the locks of the window in progress
+void CRaidVolume::asyncLock(const std::shared_ptr<TAsyncOp> &op) {
+    getRowRange(op->m_SecNr, op->m_SecCnt, op->m_FirstRow, op->m_LastRow);
+    op->m_Row = op->m_FirstRow;
+    op->m_Locks = stripeLocks.Rows(op->m_FirstRow, op->m_LastRow);
+    stripeLocks.AcquireAsync(op->m_Locks, op->m_Write ? CStripeLocks::LOCK_WRITE : CStripeLocks::LOCK_SHARED, [this, op]{
+        postAsync([this, op]{
+            op->m_Locked = true;
+            if (op->m_Write){
+                asyncWrite(op);
+            } else {
+                asyncRead(op);
+            }
+        });
+    });
+}
+
+// Next batch of an async read, batches go one after another like in readSectors
+void CRaidVolume::asyncRead(const std::shared_ptr<TAsyncOp> &op) {
+    if (op->m_Row > op->m_LastRow){
+        // Data still in the write-back buffer is newer than the drives
+        bufferRead(op->m_SecNr, op->m_Data, op->m_SecCnt);
+        updateReadahead(op->m_SecNr, op->m_SecCnt);
+        asyncFinish(op, true);
+        return;
+    }
+
+    int count = min(RAID_BATCH_ROWS, op->m_LastRow - op->m_Row + 1);
+    if (op->m_Row < rebuildRow){
+        count = min(count, rebuildRow - op->m_Row);
+    }
+    op->m_Batch.Init(deviceNum, op->m_Row, count);
+    planRead(op->m_Batch, op->m_SecNr, op->m_SecCnt, op->m_Plan, false);
+
+    batchIOAsync(op->m_Batch, op->m_Plan.m_Sectors, false, [this, op](int failed){
+        if (failed){
+            // Batch is planned again without the failed drives
+            if (failDrives(failed)){
+                asyncRead(op);
+            } else {
+                asyncFinish(op, false);
+            }
+            return;
+        }
+        finishRead(op->m_Batch, op->m_SecNr, op->m_Data, op->m_SecCnt, op->m_Plan);
+        op->m_Row += op->m_Batch.m_Rows;
+        asyncRead(op);
+    });
+}
+
+// Async write holding its locks, it goes to the write-back buffer or marks its rows in the bitmap
+void CRaidVolume::asyncWrite(const std::shared_ptr<TAsyncOp> &op) {
+    if (!writeBack){
+        // Older data of the sectors left in the buffer must not be flushed over the new one
+        bufferDiscard(op->m_SecNr, op->m_SecCnt);
+        op->m_Dirty = bitmapRows > 0;
+        markDirtyAsync(op->m_FirstRow, op->m_LastRow, [this, op](bool ok){
+            if (ok){
+                asyncWriteBatch(op);
+            } else {
+                asyncFinish(op, false);
+            }
+        });
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(bufferMutex);
+    bufferWrite(op->m_SecNr, op->m_Data, op->m_SecCnt);
+    // Buffer is full, the request is done once the flusher drained it. Without the flusher
+    // (write-back being turned off) the rows are left to the final flush.
+    if ((int)writeBuffer.size() >= RAID_WRITEBACK_ROWS && !flusherStop){
+        flushWaiters.push_back([this, op](bool ok){ asyncFinish(op, ok); });
+        flusherCond.notify_one();
+        lock.unlock();
+        stripeLocks.Release(op->m_Locks, CStripeLocks::LOCK_WRITE);
+        op->m_Locked = false;
+        return;
+    }
+    if (fullRows >= RAID_BATCH_ROWS){
+        flusherCond.notify_one();
+    }
+    lock.unlock();
+    asyncFinish(op, true);
+}
+
+// Next batch of an async write, like in writeRows
+void CRaidVolume::asyncWriteBatch(const std::shared_ptr<TAsyncOp> &op) {
+    if (op->m_Row > op->m_LastRow){
+        asyncFinish(op, true);
+        return;
+    }
+
+    int count = min(RAID_BATCH_ROWS, op->m_LastRow - op->m_Row + 1);
+    if (op->m_Row < rebuildRow){
+        count = min(count, rebuildRow - op->m_Row);
+    }
+    TRowBatch &batch = op->m_Batch;
+    TBatchPlan &plan = op->m_Plan;
+    batch.Init(deviceNum, op->m_Row, count);
+    plan.m_NewData.assign(deviceNum * count, NULL);
+    forEachSector(batch, op->m_SecNr, op->m_SecCnt, [&](int currentSector, int physDrive, int physSector){
+        plan.m_NewData[physDrive * count + physSector - batch.m_FirstRow] = op->m_Data[currentSector - op->m_SecNr];
+    });
+    planWrite(batch, plan.m_NewData, plan);
+
+    batchIOAsync(batch, plan.m_Sectors, false, [this, op](int failed){
+        if (failed){
+            if (failDrives(failed)){
+                asyncWriteBatch(op);
+            } else {
+                asyncFinish(op, false);
+            }
+            return;
+        }
+
+        encodeWrite(op->m_Batch, op->m_Plan.m_NewData, op->m_Plan);
+        batchIOAsync(op->m_Batch, op->m_Plan.m_Sectors, true, [this, op](int failed){
+            if (failed && !failDrives(failed)){
+                asyncFinish(op, false);
+                return;
+            }
+            op->m_Row += op->m_Batch.m_Rows;
+            asyncWriteBatch(op);
+        });
+    });
+}
+
+// Window leaves its bitmap regions and locks, then the next window goes on or the caller hears how
+// the request went
+void CRaidVolume::asyncFinish(const std::shared_ptr<TAsyncOp> &op, bool ok) {
+    if (op->m_Dirty){
+        doneDirty(op->m_FirstRow, op->m_LastRow);
+        op->m_Dirty = false;
+    }
+    if (op->m_Locked){
+        stripeLocks.Release(op->m_Locks, op->m_Write ? CStripeLocks::LOCK_WRITE : CStripeLocks::LOCK_SHARED);
+        op->m_Locked = false;
+    }
+    int done = op->m_SecNr + op->m_SecCnt - op->m_RequestNr;
+    if (ok && done < op->m_RequestCnt){
+        op->m_SecNr += op->m_SecCnt;
+        op->m_Data = CSegmentCursor(op->m_Request, done);
+        op->m_SecCnt = lockWindow(op->m_SecNr, op->m_RequestCnt - done);
+        asyncLock(op);
+        return;
+    }
+#if defined(RAID_LATENCY)
+    std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - op->m_Started;
+    (op->m_Write ? latency->m_Write : latency->m_Read).Record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+#endif
+
+    op->m_Done(ok);
+    std::lock_guard<std::mutex> lock(asyncMutex);
+    if (--asyncRequests == 0){
+        asyncIdle.notify_all();
+    }
+}
+
+void CRaidVolume::flusherLoop(void) {
+    std::unique_lock<std::mutex> lock(bufferMutex);
+    while (!flusherStop){
+        bool woken = flusherCond.wait_for(lock, std::chrono::milliseconds(RAID_FLUSH_MS), [this]{
+            return flusherStop || fullRows >= RAID_BATCH_ROWS || !flushWaiters.empty();
+        });
+        if (flusherStop){
+            break;
+        }
+        // Partial rows get one more period to be filled up before they are written with parity reads
+        if (!woken){
+            flushTick++;
+        }
+        // Async writes waiting for room are done once everything is written
+        std::vector<std::function<void(bool)> > waiters;
+        waiters.swap(flushWaiters);
+        if (!writeBuffer.empty() || !waiters.empty()){
+            lock.unlock();
+            bool ok = flushBuffer(!waiters.empty());
+            for (std::function<void(bool)> &waiter : waiters){
+                postAsync(std::bind(waiter, ok));
+            }
+            lock.lock();
+        }
+    }
+}
+
+bool CRaidVolume::writeBatch(TRowBatch &batch, int secNr, const CSegmentCursor &data, int secCnt) {
+
+    int rows = batch.m_Rows;
+
+    // New data for every sector of the batch, NULL if the sector is not written
+    std::vector<const char*> newData(deviceNum * rows, NULL);
+    forEachSector(batch, secNr, secCnt, [&](int currentSector, int physDrive, int physSector){
+        newData[physDrive * rows + physSector - batch.m_FirstRow] = data[currentSector - secNr];
+    });
+
+    return writeBatch(batch, newData);
+}
+
+bool CRaidVolume::writeBatch(TRowBatch &batch, const std::vector<const char*> &newData) {
+
+    TBatchPlan plan;
+    while (true){
+        planWrite(batch, newData, plan);
+        int failed = batchIO(batch, plan.m_Sectors, false);
+        if (!failed){
+            break;
+        }
+        if (!failDrives(failed)){
+            return false;
+        }
+    }
+
+    encodeWrite(batch, newData, plan);
+
+    // Every other drive still gets its sectors, so rows stay consistent even if one drive fails
+    int failed = batchIO(batch, plan.m_Sectors, true);
+    if (failed && !failDrives(failed)){
+        return false;
+    }
+
+    return true;
+}
+
+// Picks the way parity of every written row is made and marks the old sectors it needs
+void CRaidVolume::planWrite(TRowBatch &batch, const std::vector<const char*> &newData, TBatchPlan &plan) {
+
+    int rows = batch.m_Rows;
+
+    // Drives getting new data in every row
+    std::vector<int> &written = plan.m_Written;
+    written.assign(rows, 0);
+    for (int i = 0; i < deviceNum * rows; i++){
+        if (newData[i]){
+            written[i % rows] |= 1 << (i / rows);
+        }
+    }
+
+    int lost = plan.m_Lost = rowFailedDrives(batch.m_FirstRow);
+    std::vector<char> &sectors = plan.m_Sectors;
+    std::vector<char> &mode = plan.m_Mode;
+
+    // Full rows need nothing. Others read old data and old parity (RMW), or the data not
+    // being written (reconstruct-write), whichever is fewer sectors and does not need a lost
+    // drive. If both do, lost data is recovered from the rest of the row first.
+    sectors.assign(deviceNum * rows, 0);
+    mode.assign(rows, TBatchPlan::ROW_NONE);
+    for (int row = 0; row < rows; row++){
+        int physSector = batch.m_FirstRow + row;
+        int parity = getParityDrives(physSector);
+        int untouched = ((1 << deviceNum) - 1) & ~parity & ~written[row];
+        if (!written[row] || (parity & ~lost) == 0){
+            continue;
+        }
+        if (!untouched){
+            mode[row] = TBatchPlan::ROW_FULL;
+            continue;
+        }
+
+        int reads = 0;
+        bool rmw = !(written[row] & lost);
+        bool reconstruct = !(untouched & lost);
+        if (reconstruct && (!rmw || __builtin_popcount(untouched) < __builtin_popcount(written[row] | (parity & ~lost)))){
+            mode[row] = TBatchPlan::ROW_RECONSTRUCT;
+            reads = untouched;
+        } else if (rmw){
+            mode[row] = TBatchPlan::ROW_RMW;
+            reads = written[row] | (parity & ~lost);
+        } else {
+            mode[row] = TBatchPlan::ROW_RECOVER;
+            reads = recoverSources(physSector, lost);
+        }
+        for (int i = 0; i < deviceNum; i++){
+            if (reads & (1 << i)){
+                sectors[i * rows + row] = 1;
+            }
+        }
+    }
+    cacheLookup(batch, sectors);
+}
+
+// Old sectors are in the batch, new data and parity go in and are marked to be written
+void CRaidVolume::encodeWrite(TRowBatch &batch, const std::vector<const char*> &newData, TBatchPlan &plan) {
+
+    int rows = batch.m_Rows;
+    int lost = plan.m_Lost;
+    const std::vector<int> &written = plan.m_Written;
+    const std::vector<char> &mode = plan.m_Mode;
+    std::vector<char> &sectors = plan.m_Sectors;
+
+    static const int modeStats[] = { -1, STAT_FULL_ROWS, STAT_RMW_ROWS, STAT_RECONSTRUCT_ROWS, STAT_RECOVER_ROWS };
+    for (int row = 0; row < rows; row++){
+        if (mode[row] != TBatchPlan::ROW_NONE){
+            stats.Add(modeStats[(int)mode[row]], 1);
+        }
+    }
+
+    // Calculating new parity and placing new data into the batch
+    std::fill(sectors.begin(), sectors.end(), 0);
+    for (int row = 0; row < rows; row++){
+        if (!written[row]){
+            continue;
+        }
+
+        int physSector = batch.m_FirstRow + row;
+        int parityDrive = getParityDrive(physSector);
+        int qDrive = getQDrive(physSector);
+        int parity = getParityDrives(physSector);
+
+        // Old data is xored out of old parity and new data xored in, Q takes them times g^drive
+        if (mode[row] == TBatchPlan::ROW_RMW){
+            const char *sources[2 * MAX_RAID_DEVICES];
+            unsigned char coefs[2 * MAX_RAID_DEVICES];
+            int sourceCnt = 1;
+            for (int i = 0; i < deviceNum; i++){
+                const char *sector = newData[i * rows + row];
+                if (sector){
+                    coefs[sourceCnt] = coefs[sourceCnt + 1] = gfTables.Pow(i);
+                    sources[sourceCnt++] = batch.Sector(i, physSector);
+                    sources[sourceCnt++] = sector;
+                }
+            }
+            coefs[0] = 1;
+            if (!(lost & (1 << parityDrive))){
+                sources[0] = batch.Sector(parityDrive, physSector);
+                XORSources(batch.Sector(parityDrive, physSector), sources, sourceCnt, 1);
+            }
+            if (qDrive >= 0 && !(lost & (1 << qDrive))){
+                sources[0] = batch.Sector(qDrive, physSector);
+                GFSources(batch.Sector(qDrive, physSector), sources, coefs, sourceCnt, SECTOR_SIZE);
+            }
+        }
+
+        if (mode[row] == TBatchPlan::ROW_RECOVER){
+            recoverRows(batch, physSector, 1, lost);
+        }
+
+        for (int i = 0; i < deviceNum; i++){
+            const char *sector = newData[i * rows + row];
+            if (sector){
+                memcpy(batch.Sector(i, physSector), sector, SECTOR_SIZE);
+                sectors[i * rows + row] = 1;
+            }
+        }
+
+        // Full, reconstructed and recovered rows get parity straight from the data of the row
+        if (mode[row] == TBatchPlan::ROW_FULL || mode[row] == TBatchPlan::ROW_RECONSTRUCT || mode[row] == TBatchPlan::ROW_RECOVER){
+            encodeRows(batch, physSector, 1, parity);
+        }
+
+        for (int i = 0; i < deviceNum; i++){
+            if (!(parity & (1 << i))){
+                continue;
+            }
+            // Parity of a failed drive was not read, so only a row made from its data knows it
+            if ((lost & (1 << i)) && (mode[row] == TBatchPlan::ROW_NONE || mode[row] == TBatchPlan::ROW_RMW)){
+                cache.Drop(physSector, i);
+            } else if (mode[row] != TBatchPlan::ROW_NONE){
+                sectors[i * rows + row] = 1;
+            }
+        }
+    }
+    cacheStore(batch, sectors);
+
+    // Failed drives are skipped, new parity covers their sectors
+    for (int i = 0; i < deviceNum; i++){
+        if (lost & (1 << i)){
+            std::fill(sectors.begin() + i * rows, sectors.begin() + (i+1) * rows, 0);
+        }
+    }
+}
+
+// Drives with a marked sector
+int CRaidVolume::batchDrives(TRowBatch &batch, const std::vector<char> &sectors) {
+    int rows = batch.m_Rows;
+    int drives = 0;
     for (int i = 0; i < deviceNum; i++){
-        timestamps[i] = ReadService(i);
+        if (std::find(sectors.begin() + i * rows, sectors.begin() + (i+1) * rows, 1) != sectors.begin() + (i+1) * rows){
+            drives |= 1 << i;
+        }
+    }
+    return drives;
+}
 
-        // Checks if drive failed read
-        if (timestamps[i] < 42){
-            zeroCnt++;
-            // if there were two failed drives
-            if (zeroCnt >= 2){
-                raidStatus = RAID_FAILED;
+// Reads or writes the marked sectors of one drive in runs, false if a call fails
+bool CRaidVolume::driveRuns(TRowBatch &batch, const std::vector<char> &sectors, bool write, int drive) {
+    int rows = batch.m_Rows;
+    const char *marked = &sectors[drive * rows];
+
+    int row = 0;
+    while (row < rows){
+        if (!marked[row]){
+            row++;
+            continue;
+        }
+
+        // Extending the run, short gaps are read along when reading
+        int last = row;
+        for (int next = row + 1; next < rows && next - last <= (write ? 1 : RAID_READ_GAP + 1); next++){
+            if (marked[next]){
+                last = next;
+            }
+        }
+
+        int physSector = batch.m_FirstRow + row;
+        int count = last - row + 1;
+        int ret = write ? writeDrive(drive, physSector, batch.Sector(drive, physSector), count)
+                        : readDrive(drive, physSector, batch.Sector(drive, physSector), count);
+        if (ret != count){
+            return false;
+        }
+        row = last + 1;
+    }
+    return true;
+}
+
+int CRaidVolume::batchIO(TRowBatch &batch, const std::vector<char> &sectors, bool write) {
+
+    // Every drive goes through its runs on its own thread
+    bool failed[MAX_RAID_DEVICES] = {};
+    drivePool.Run(batchDrives(batch, sectors), [&](int i){
+        failed[i] = !driveRuns(batch, sectors, write, i);
+    });
+
+    int mask = 0;
+    for (int i = 0; i < deviceNum; i++){
+        if (failed[i]){
+            mask |= 1 << i;
+        }
+    }
+
+    return mask;
+}
+
+// Like batchIO, but the drive threads are left to it. Done gets the failed drives on an async
+// worker, batch and sectors have to stay until then.
+void CRaidVolume::batchIOAsync(TRowBatch &batch, const std::vector<char> &sectors, bool write, std::function<void(int)> done) {
+
+    std::shared_ptr<std::atomic<int> > failed(new std::atomic<int>(0));
+    drivePool.RunAsync(batchDrives(batch, sectors), [this, &batch, &sectors, write, failed](int i){
+        if (!driveRuns(batch, sectors, write, i)){
+            failed->fetch_or(1 << i);
+        }
+    }, [this, failed, done]{
+        postAsync([failed, done]{
+            done(*failed);
+        });
+    });
+}
+
+bool CRaidVolume::failDrives(int mask) {
+
+    std::lock_guard<std::recursive_mutex> lock(stateMutex);
+    bool newFailure = false;
+    bool wasOk = raidStatus == RAID_OK;
+
+    for (int i = 0; i < deviceNum; i++){
+        if (!(mask & (1 << i))){
+            continue;
+        }
+
+        // Drive being rebuilt failed again, its rebuilt rows can not be used anymore
+        if (failedDrives() & (1 << i)){
+            rebuildRow = 0;
+            continue;
+        }
+
+        // Failed drives up to the parity count make raid degraded, one more fails it
+        if (raidStatus == RAID_OK){
+            raidStatus = RAID_DEGRADED;
+            raidFailedDrive = i;
+        } else if (raidStatus == RAID_DEGRADED && parityNum > 1 && raidFailedDrive2 < 0){
+            raidFailedDrive2 = max(i, raidFailedDrive);
+            raidFailedDrive = min(i, raidFailedDrive);
+        } else {
+            raidStatus = RAID_FAILED;
+            continue;
+        }
+        // Rows rebuilt so far miss the new drive, rebuild starts over with both
+        rebuildRow = 0;
+        newFailure = true;
+    }
+
+    // Timestamp moves on right away, so the failed drive is recognized even after a crash.
+    // The old one stays with the drive, so it can be resynced from the bitmap if it comes back.
+    if (newFailure && raidStatus == RAID_DEGRADED){
+        if (wasOk){
+            degradedSince = raidServiceData;
+        }
+        raidServiceData++;
+        writeServices();
+    }
+
+    return raidStatus != RAID_FAILED;
+}
+
+int CRaidVolume::Resync(void) {
+
+    std::lock_guard<std::mutex> lock(resyncMutex);
+    if (raidStatus == RAID_FAILED || raidStatus == RAID_STOPPED || raidStatus == RAID_OK){
+        return raidStatus;
+    }
+
+    // Buffered rows are written first, so the rebuilt drive gets them through the rest of the row
+    if (!flushBuffer(true)){
+        return raidStatus;
+    }
+
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
+    // Two steps in flight, one is being read while the other one is calculated and written.
+    // Steps are read without their stripe locks, lock versions tell which ones were written since.
+    TRowBatch batches[2];
+    std::unique_ptr<CLatch> reads[2];
+    bool failed[2][MAX_RAID_DEVICES] = {};
+    unsigned versions[2][RAID_STRIPE_LOCKS];
+
+    // Checkpoint of the last step, written by drive threads behind reads of the next step
+    std::unique_ptr<CLatch> checkpoint;
+    bool checkpointFailed[MAX_RAID_DEVICES] = {};
+    alignas(RAID_IO_ALIGN) char checkpointSector[SECTOR_SIZE];
+
+    // Every failed drive is rebuilt by the same pass
+    int lost = failedDrives();
+    int lostNum = __builtin_popcount(lost);
+
+    // Starts reading rows of a step from all the surviving drives
+    auto readStep = [&](int slot, int row, int count){
+        batches[slot].Init(deviceNum, row, count);
+        reads[slot].reset(new CLatch(deviceNum-lostNum));
+        for (int i = 0; i < RAID_STRIPE_LOCKS; i++){
+            versions[slot][i] = stripeLocks.Version(i);
+        }
+
+        for (int i = 0; i < deviceNum; i++){
+            if (lost & (1 << i)){
+                continue;
+            }
+            drivePool.Submit(i, [this, &batches, &reads, &failed, slot, row, count, i]{
+                failed[slot][i] = readDrive(i, row, batches[slot].Sector(i, row), count) != count;
+                reads[slot]->Done();
+            });
+        }
+    };
+
+    // Fresh rebuild marks the drives, so that its checkpoint is only trusted for these very drives.
+    // Drives that still have the timestamp they dropped out with only need regions written since.
+    std::unique_lock<std::recursive_mutex> state(stateMutex);
+    if (rebuildRow == 0){
+        rebuildDirty = bitmapRows > 0 && degradedSince >= 42;
+        for (int i = 0; i < deviceNum; i++){
+            if (lost & (1 << i)){
+                int timestamp = ReadService(i);
+                rebuildDirty = rebuildDirty && timestamp >= degradedSince && timestamp < raidServiceData;
+            }
+        }
+        rebuildId = (int)(std::chrono::system_clock::now().time_since_epoch().count() | 1);
+        if (!writeServices()){
+            return raidStatus;
+        }
+        for (int i = 0; i < deviceNum; i++){
+            if ((lost & (1 << i)) && !WriteService(i, 0)){
                 return raidStatus;
             }
         }
     }
+    int rebuilt = rebuildRow;
+    state.unlock();
 
-    int timestamp = 0;
-    // If 0 == 1
-    if (timestamps[0] == timestamps[1]){
-        timestamp = timestamps[0];
-        for (int i = 2; i < deviceNum; i++){
-            if (timestamp != timestamps[i]){
-                if(raidStatus == RAID_DEGRADED){
-                    raidStatus = RAID_FAILED;
-                    return raidStatus;
+    // First row from given one that has to be rebuilt
+    auto nextStep = [&](int row){
+        while (row < rowNum && rebuildDirty && !regionDirty(row, row)){
+            row = (row / bitmapRows + 1) * bitmapRows;
+        }
+        return min(row, rowNum);
+    };
+    // Rows rebuilt by the step starting at given row, a step stops at the first clean region
+    auto stepRows = [&](int row){
+        int last = min(row + RAID_RESYNC_ROWS, rowNum);
+        if (rebuildDirty){
+            for (int next = (row / bitmapRows + 1) * bitmapRows; next < last; next += bitmapRows){
+                if (!regionDirty(next, next)){
+                    last = next;
                 }
-                raidStatus = RAID_DEGRADED;
-                raidFailedDrive = i;
             }
         }
-    } else {
-        // 0 != 1 but 1 == 2
-        if (timestamps[1] == timestamps[2]){
-            raidStatus = RAID_DEGRADED;
-            raidFailedDrive = 0;
-            timestamp = timestamps[1];
+        return last - row;
+    };
+    auto stepFailed = [&](int slot){
+        return std::find(failed[slot], failed[slot] + deviceNum, true) != failed[slot] + deviceNum;
+    };
 
-        } else if (timestamps[0] == timestamps[2]) { //0 != 1 but 0 == 2
-            raidStatus = RAID_DEGRADED;
-            raidFailedDrive = 1;
-            timestamp = timestamps[0];
+    int status = RAID_OK;
+    int rebuiltRows = 0;
+    int row = nextStep(rebuilt);
+    if (row < rowNum){
+        readStep(0, row, stepRows(row));
+    }
+
+    for (int slot = 0; ; slot ^= 1){
+        int count = row < rowNum ? batches[slot].m_Rows : 0;
+        RAID_LATENCY_SCOPE(latency->m_ResyncRow, count);
+        RAID_TRACE_SCOPE("Resync", -1, row, count);
+        if (count > 0){
+            reads[slot]->Wait();
+            if (stepFailed(slot)){
+                status = RAID_FAILED;
+                break;
+            }
+        }
+
+        // Rows skipped on the way to the step are locked with it, writes there made their regions dirty.
+        // Only the lost drives are written, prefetches leave them out, so lock versions stay.
+        CStripeGuard guard(stripeLocks, stripeLocks.Rows(rebuilt, row + count - 1), CStripeLocks::LOCK_EXCLUSIVE);
+        state.lock();
+        bool changed = failedDrives() != lost || raidStatus != RAID_DEGRADED || rebuildRow != rebuilt;
+        state.unlock();
+        if (changed){
+            // Drives failed or came back meanwhile, rebuild goes on with the next Resync
+            status = RAID_DEGRADED;
+            break;
+        }
+        int first = nextStep(rebuilt);
+        if (first < row){
+            readStep(slot ^ 1, first, stepRows(first));
+            row = first;
+            continue;
+        }
+        if (row >= rowNum){
+            // Rows not rebuilt are still locked, so no write misses the drives becoming healthy
+            if (checkpoint){
+                checkpoint->Wait();
+                checkpoint.reset();
+                if (std::find(checkpointFailed, checkpointFailed + deviceNum, true) != checkpointFailed + deviceNum){
+                    status = RAID_FAILED;
+                    break;
+                }
+            }
+
+            // Drive is in sync, checkpoint is dropped
+            state.lock();
+            rebuildRow = 0;
+            rebuildId = 0;
+            rebuildDirty = false;
+            degradedSince = 0;
+            for (int i = 0; i < deviceNum; i++){
+                if ((lost & (1 << i)) && !WriteService(i, raidServiceData)){
+                    status = RAID_DEGRADED;
+                }
+            }
+            if (status == RAID_OK){
+                raidStatus = RAID_OK;
+                raidFailedDrive = -1;
+                raidFailedDrive2 = -1;
+            }
+            state.unlock();
+            break;
+        }
+
+        // Step written to since it was read is read again, its rows can not change now
+        TStripeSet stepLocks = stripeLocks.Rows(row, row + count - 1);
+        for (int i = 0; i < RAID_STRIPE_LOCKS; i++){
+            if (stepLocks[i] && stripeLocks.Version(i) != versions[slot][i]){
+                readStep(slot, row, count);
+                reads[slot]->Wait();
+                break;
+            }
+        }
+        if (stepFailed(slot)){
+            status = RAID_FAILED;
+            break;
+        }
+
+        int next = nextStep(row + count);
+        if (next < rowNum){
+            readStep(slot ^ 1, next, stepRows(next));
+        }
+
+        // Lost data comes back from the rest of the row, lost parity is calculated from the data
+        recoverRows(batches[slot], row, count, lost);
+        encodeRows(batches[slot], row, count, lost);
 
-        } else { // 0 != 1, 1 != 2, 0 != 2
+        bool writeFailed[MAX_RAID_DEVICES] = {};
+        drivePool.Run(lost, [&](int i){
+            writeFailed[i] = writeDrive(i, row, batches[slot].Sector(i, row), count) != count;
+        });
+        if (std::find(writeFailed, writeFailed + deviceNum, true) != writeFailed + deviceNum){
+            status = RAID_DEGRADED;
+            break;
+        }
+
+        // Rebuilt rows are used from now on, the checkpoint lets Resync continue after an interruption
+        if (checkpoint){
+            checkpoint->Wait();
+            if (std::find(checkpointFailed, checkpointFailed + deviceNum, true) != checkpointFailed + deviceNum){
+                status = RAID_FAILED;
+                break;
+            }
+        }
+
+        state.lock();
+        rebuildRow = rebuilt = row + count;
+        rebuiltRows += count;
+        stats.Add(STAT_RESYNC_ROWS, count);
+        unsigned long long checkpointSeq = fillService(checkpointSector, raidServiceData);
+        checkpoint.reset(new CLatch(deviceNum-lostNum));
+        for (int i = 0; i < deviceNum; i++){
+            if (!(lost & (1 << i))){
+                drivePool.Submit(i, [this, &checkpoint, &checkpointFailed, &checkpointSector, checkpointSeq, i]{
+                    checkpointFailed[i] = !writeServiceSector(i, checkpointSector, checkpointSeq);
+                    checkpoint->Done();
+                });
+            }
+        }
+        state.unlock();
+        row = next;
+    }
+
+    // Step read ahead or checkpoint may still be running after an error
+    for (int slot = 0; slot < 2; slot++){
+        if (reads[slot]){
+            reads[slot]->Wait();
+        }
+    }
+    if (checkpoint){
+        checkpoint->Wait();
+        if (std::find(checkpointFailed, checkpointFailed + deviceNum, true) != checkpointFailed + deviceNum){
+            status = RAID_FAILED;
+        }
+    }
+
+    if (status != RAID_OK){
+        state.lock();
+        if (status == RAID_FAILED){
             raidStatus = RAID_FAILED;
-            return raidStatus;
         }
+        return raidStatus;
+    }
 
-        // checks rest of the drives against the valid timestamp
-        for (int i = 3; i < deviceNum; i++){
-            if (timestamp != timestamps[i]){
-                raidStatus = RAID_FAILED;
-                return raidStatus;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    resyncRate = seconds > 0 ? (double)rebuiltRows * lostNum * SECTOR_SIZE / 1e6 / seconds : 0;
+
+    // All rows are in sync on all drives again, regions being written stay dirty
+    if (bitmapRows > 0){
+        std::unique_lock<std::mutex> bitmapLock(bitmapMutex);
+        std::fill(bitmap.begin(), bitmap.end(), 0);
+        for (size_t region = 0; region < bitmapWriters.size(); region++){
+            if (bitmapWriters[region] > 0){
+                bitmap[region / 8] |= 1 << (region % 8);
             }
         }
+        bitmapActive = bitmap;
+        syncBitmap(bitmapLock, ++bitmapVersion);
     }
-    //todo check this if this doesnt cause problems
-    raidServiceData = timestamp;
+
+    // Old checkpoint left on other drives is harmless, the rebuilt drive no longer carries its id
+    writeServices();
     return raidStatus;
 }
 
-int CRaidVolume::Stop(void) {
-    raidServiceData++;
+void CRaidVolume::XORSectors(char* result, const char *sector, int count) {
+    stats.Add(STAT_PARITY_BYTES, (long long)count * SECTOR_SIZE);
+    xorBlocks(result, sector, (size_t)count * SECTOR_SIZE);
+}
 
-    if (raidStatus == RAID_FAILED){
-        raidStatus = RAID_STOPPED;
-        return raidStatus;
-    }
+void CRaidVolume::XORSources(char* result, const char **sources, int sourceCnt, int count) {
+    stats.Add(STAT_PARITY_BYTES, (long long)sourceCnt * count * SECTOR_SIZE);
+    xorSources(result, sources, sourceCnt, (size_t)count * SECTOR_SIZE);
+}
 
-    for (int i = 0; i < deviceNum; i++){
-        if (i == raidFailedDrive){ continue; }
-        WriteService(i, raidServiceData);
-    }
+void CRaidVolume::GFSources(char* result, const char **sources, const unsigned char *coefs, int sourceCnt, size_t len) {
+    stats.Add(STAT_PARITY_BYTES, (long long)sourceCnt * len);
+    gfSources(result, sources, coefs, sourceCnt, len);
+}
 
-    raidStatus = RAID_STOPPED;
-    return raidStatus;
+int CRaidVolume::readDrive(int drive, int secNr, void *data, int secCnt) {
+    RAID_LATENCY_SCOPE(latency->m_DriveRead[drive], 1);
+    RAID_TRACE_SCOPE("driveRead", drive, secNr, secCnt);
+    stats.Add(STAT_DRIVE_READS + drive, 1);
+    stats.Add(STAT_DRIVE_READ_SECTORS + drive, secCnt);
+    return driveRead(drive, secNr, data, secCnt);
 }
 
-bool CRaidVolume::Read(int secNr, void *data, int secCnt) {
+int CRaidVolume::writeDrive(int drive, int secNr, const void *data, int secCnt) {
+    RAID_LATENCY_SCOPE(latency->m_DriveWrite[drive], 1);
+    RAID_TRACE_SCOPE("driveWrite", drive, secNr, secCnt);
+    stats.Add(STAT_DRIVE_WRITES + drive, 1);
+    stats.Add(STAT_DRIVE_WRITE_SECTORS + drive, secCnt);
+    return driveWrite(drive, secNr, data, secCnt);
+}
+
+// Calculates parity sectors of given drives for a run of rows from the data in the batch
+void CRaidVolume::encodeRows(TRowBatch &batch, int row, int count, int drives) {
+    int lastRow = row + count;
+    for (int from = row, to; from < lastRow; from = to){
+        // Rows of one stripe share their parity drives
+        to = min(lastRow, (from / chunkSectors + 1) * chunkSectors);
+        int parityDrive = getParityDrive(from);
+        int qDrive = getQDrive(from);
 
-    int physSector = 0;
-    int physDrive = 0;
+        const char *sources[MAX_RAID_DEVICES];
+        unsigned char coefs[MAX_RAID_DEVICES];
+        int sourceCnt = 0;
+        for (int i = 0; i < deviceNum; i++){
+            if (i != parityDrive && i != qDrive){
+                sources[sourceCnt] = batch.Sector(i, from);
+                coefs[sourceCnt++] = gfTables.Pow(i);
+            }
+        }
 
-    char *dataTmp = (char*)data;
+        if (drives & (1 << parityDrive)){
+            XORSources(batch.Sector(parityDrive, from), sources, sourceCnt, to - from);
+        }
+        // Q is sum of data of every drive multiplied by the generator raised to the drive number
+        if (qDrive >= 0 && (drives & (1 << qDrive))){
+            GFSources(batch.Sector(qDrive, from), sources, coefs, sourceCnt, (size_t)(to - from) * SECTOR_SIZE);
+        }
+    }
+}
 
-    //iterating through sectors if we read more of them
-    for(int currentSector = secNr; currentSector < secCnt+secNr; currentSector++){
-        physSector = getPhysicalSector(currentSector);
-        physDrive = getPhysicalDrive(currentSector);
+// Drives a row has to be read from to recover its lost data
+int CRaidVolume::recoverSources(int row, int lost) {
+    int drives = ((1 << deviceNum) - 1) & ~lost;
+    int lostData = lost & ~getParityDrives(row);
+    int qDrive = getQDrive(row);
 
-        // If all is okay reads sector
-        if (raidStatus == RAID_OK){
-            // If read fails turns drive to degraded
-            int ret = driveRead(physDrive, physSector, dataTmp, 1);
-            if ( ret != 1 ){
-                raidStatus = RAID_DEGRADED;
-                raidFailedDrive = physDrive;
-                currentSector--;
-                continue;
-            }
+    // One lost data sector is xor of the rest while parity is there, Q is needed otherwise
+    if (qDrive >= 0 && __builtin_popcount(lostData) == 1 && !(lost & (1 << getParityDrive(row)))){
+        drives &= ~(1 << qDrive);
+    }
+    return drives;
+}
+
+// Recovers lost data sectors of a run of rows from the sectors recoverSources gave
+void CRaidVolume::recoverRows(TRowBatch &batch, int row, int count, int lost) {
+    int lastRow = row + count;
+    for (int from = row, to; from < lastRow; from = to){
+        to = min(lastRow, (from / chunkSectors + 1) * chunkSectors);
+        int parityDrive = getParityDrive(from);
+        int qDrive = getQDrive(from);
+        int lostData = lost & ~getParityDrives(from);
+        if (!lostData){
+            continue;
         }
 
-        // If drive is degraded, tries to read sector, if its degraded sector calculates it
-        if (raidStatus == RAID_DEGRADED){
-            if (physDrive == raidFailedDrive){
+        int x = __builtin_ctz(lostData);
+        int y = lostData & (lostData - 1) ? __builtin_ctz(lostData & (lostData - 1)) : -1;
+        size_t len = (size_t)(to - from) * SECTOR_SIZE;
 
-                // If calculating failed drive fails then RAID FAILED
-                if (!calculateDegradedSector(dataTmp, raidFailedDrive, physSector)){
-                    raidStatus = RAID_FAILED;
-                    break;
+        const char *sources[MAX_RAID_DEVICES];
+        unsigned char coefs[MAX_RAID_DEVICES];
+        int sourceCnt = 0;
+
+        if (y < 0 && !(lost & (1 << parityDrive))){
+            // Lost data is xor of parity and the rest of the data
+            for (int i = 0; i < deviceNum; i++){
+                if (i != x && i != qDrive){
+                    sources[sourceCnt++] = batch.Sector(i, from);
                 }
-            } else {
-                int ret = driveRead(physDrive, physSector, dataTmp, 1);
-                if ( ret != 1 ){
-                    raidStatus = RAID_FAILED;
-                    break;
+            }
+            XORSources(batch.Sector(x, from), sources, sourceCnt, to - from);
+        } else if (y < 0){
+            // Parity is gone too, D_x = (Q + sum of g^d * D_d) / g^x
+            int gx = gfTables.Pow(x);
+            for (int i = 0; i < deviceNum; i++){
+                if (i == qDrive){
+                    coefs[sourceCnt] = gfTables.Div(1, gx);
+                } else if (i != x && i != parityDrive){
+                    coefs[sourceCnt] = gfTables.Div(gfTables.Pow(i), gx);
+                } else {
+                    continue;
                 }
+                sources[sourceCnt++] = batch.Sector(i, from);
             }
-        }
+            GFSources(batch.Sector(x, from), sources, coefs, sourceCnt, len);
+        } else {
+            // Two lost data sectors, with P' and Q' being parity and Q of the rest of the data:
+            // D_x = (g^y * P' + Q') / (g^x + g^y), all of it in one pass, and D_y = P' + D_x
+            int gy = gfTables.Pow(y);
+            int denom = gfTables.Pow(x) ^ gy;
+            int a = gfTables.Div(gy, denom);
+            int b = gfTables.Div(1, denom);
+            for (int i = 0; i < deviceNum; i++){
+                if (i == parityDrive){
+                    coefs[sourceCnt] = a;
+                } else if (i == qDrive){
+                    coefs[sourceCnt] = b;
+                } else if (i != x && i != y){
+                    coefs[sourceCnt] = a ^ gfTables.Mul(b, gfTables.Pow(i));
+                } else {
+                    continue;
+                }
+                sources[sourceCnt++] = batch.Sector(i, from);
+            }
+            GFSources(batch.Sector(x, from), sources, coefs, sourceCnt, len);
 
-        // If raid fails then returns false
-        if (raidStatus == RAID_FAILED){
-            return false;
+            sourceCnt = 0;
+            for (int i = 0; i < deviceNum; i++){
+                if (i != y && i != qDrive){
+                    sources[sourceCnt++] = batch.Sector(i, from);
+                }
+            }
+            XORSources(batch.Sector(y, from), sources, sourceCnt, to - from);
         }
-
-        // Shifting pointer if more sectors read at the same time
-        dataTmp = dataTmp + SECTOR_SIZE;
     }
+}
 
-    return true;
+CRaidVolume::CRaidVolume(){
+    raidStatus = RAID_STOPPED;
+    raidServiceData = 0;
+    sectorNum = 0;
+    deviceNum = 0;
+    chunkSectors = 1;
+    parityNum = 1;
+    rowNum = 0;
+    resyncRate = 0;
+    rebuildRow = 0;
+    rebuildId = 0;
+    rebuildDirty = false;
+    bitmapRows = 0;
+    bitmapWrites = 0;
+    bitmapVersion = 0;
+    bitmapWritten = 0;
+    bitmapWriting = false;
+    cacheRows = RAID_CACHE_ROWS;
+    writeBack = false;
+    fullRows = 0;
+    flushTick = 0;
+    flusherStop = false;
+    asyncRequests = 0;
+    asyncStop = false;
+    serviceSeq = 0;
+    readaheadTick = 0;
+    readaheadWindows = 0;
+    degradedSince = 0;
+    raidFailedDrive = -1;
+    raidFailedDrive2 = -1;
+    driveRead = NULL;
+    driveWrite = NULL;
+    queueDepth = RAID_QUEUE_DEPTH;
+#if defined(RAID_LATENCY)
+    latency.reset(new TLatencyHistograms);
+#endif
 }
 
-bool CRaidVolume::Write(int secNr, const void *data, int secCnt) {
+CRaidVolume::~CRaidVolume(){
+    stopAsync();
+    stopFlusher();
+    readaheadDrop();
+}
 
-    int physSector = 0;
-    int physDrive = 0;
-    int parityDrive = 0;
-    int ret = 0;
+bool CRaidVolume::Create(const TBlkDev &dev, int chunkSectors, int parityDrives) {
+
+    // Last sector holds service data, the one before it the write-intent bitmap
+    if (chunkSectors <= 0 || chunkSectors > dev.m_Sectors-2){
+        return false;
+    }
+    // Every row keeps at least two data sectors
+    if (parityDrives < 1 || parityDrives > 2 || dev.m_Devices < parityDrives + 2){
+        return false;
+    }
 
-    char *dataTmp = (char*)data;
+    // Bitmap regions are made of whole chunks, so that all bits fit into one sector
+    int rows = (dev.m_Sectors-2) / chunkSectors * chunkSectors;
+    int bitmapRows = (rows + RAID_BITMAP_BITS - 1) / RAID_BITMAP_BITS;
+    bitmapRows = (bitmapRows + chunkSectors - 1) / chunkSectors * chunkSectors;
 
-    // Iterating through sectors if we write more of them
-    for(int currentSector = secNr; currentSector < secCnt+secNr; currentSector++){
-        physSector = getPhysicalSector(currentSector);
-        physDrive = getPhysicalDrive(currentSector);
-        parityDrive = getParityDrive(physSector);
+    alignas(RAID_IO_ALIGN) char sector[SECTOR_SIZE];
+    memset(sector, 0, SECTOR_SIZE);
 
-        // prepping buffers for old stuff
-        char oldData[SECTOR_SIZE];
-        char oldParity[SECTOR_SIZE];
+    // Clean bitmap on all drives
+    for (int i = 0; i < dev.m_Devices; i++){
+        int ret = dev.m_Write(i, dev.m_Sectors-2, sector, 1);
+        if (ret != 1){
+            return false;
+        }
+    }
 
-        // If raid is ok simply write
-        if(raidStatus == RAID_OK){
+    TRaidService service;
+    memset(&service, 0, sizeof(service));
+    service.m_Timestamp = 42;
+    service.m_ChunkSectors = chunkSectors;
+    service.m_RebuildDrive = -1;
+    service.m_RebuildDrive2 = -1;
+    service.m_BitmapRows = bitmapRows;
+    service.m_ParityDrives = parityDrives;
+    memcpy(sector, &service, sizeof(service));
 
-            // Read old data from drive
-            ret = driveRead(physDrive, physSector, oldData, 1);
-            if (ret != 1){
-                raidStatus = RAID_DEGRADED;
-                raidFailedDrive = physDrive;
-                currentSector--;
-                continue;
-            }
+    // Writing initial service data to all drives' last sector
+    for (int i = 0; i < dev.m_Devices; i++){
+        int ret = dev.m_Write(i, dev.m_Sectors-1, sector, 1);
+        if (ret != 1){
+            return false;
+        }
+    }
+    return true;
+}
 
-            // Read old parity for given row
-            ret = driveRead(parityDrive, physSector, oldParity, 1);
-            if (ret != 1){
-                raidStatus = RAID_DEGRADED;
-                raidFailedDrive = parityDrive;
-                currentSector--;
-                continue;
-            }
+int CRaidVolume::getPhysicalDrive(int secNum) {
+    // Stripe holds one chunk from every drive but the parity ones
+    int stripeSectors = (deviceNum-parityNum) * chunkSectors;
+    int stripe = secNum / stripeSectors;
+    return getDataDrive(stripe * chunkSectors, secNum % stripeSectors / chunkSectors);
+}
 
-            // Xor out old data
-            XORSectors(oldParity, oldData);
-            // XOR in new data
-            XORSectors(oldParity, dataTmp);
+int CRaidVolume::getParityDrive(int row){
+    // Parity drive rotates with every stripe
+    return row / chunkSectors % deviceNum;
+}
 
-            // Write new parity
-            ret = driveWrite(parityDrive, physSector, oldParity, 1);
-            if ( ret != 1 ){
-                raidStatus = RAID_DEGRADED;
-                raidFailedDrive = parityDrive;
-                currentSector--;
-                continue;
-            }
+int CRaidVolume::getQDrive(int row){
+    // Q syndrome sits on the drive after the parity one
+    return parityNum > 1 ? (getParityDrive(row) + 1) % deviceNum : -1;
+}
 
-            // Write new data
-            ret = driveWrite(physDrive, physSector, dataTmp, 1);
-            if ( ret != 1 ){
-                raidStatus = RAID_DEGRADED;
-                raidFailedDrive = physDrive;
-                currentSector--;
-                continue;
-            }
+int CRaidVolume::getParityDrives(int row){
+    int q = getQDrive(row);
+    return (1 << getParityDrive(row)) | (q >= 0 ? 1 << q : 0);
+}
 
-        }
+int CRaidVolume::getDataDrive(int row, int chunk){
+    // Chunks are placed on drives in order, skipping the parity ones
+    int parity = getParityDrive(row);
+    int q = getQDrive(row);
+    int drive = chunk;
+    if (drive >= (q >= 0 ? min(parity, q) : parity)){
+        drive++;
+    }
+    if (q >= 0 && drive >= max(parity, q)){
+        drive++;
+    }
+    return drive;
+}
 
-        // If raid is degraded and we write into failed drive we recalculate parity
-        // if failed drive is the one we want to write into, just recalculate parity
-        if (raidStatus == RAID_DEGRADED){
-            if (physDrive == raidFailedDrive){
-                if (!calculateDegradedSector(oldData, physDrive, physSector)){
-                    raidStatus = RAID_FAILED;
-                    break;
-                }
+int CRaidVolume::getPhysicalSector(int secNum) {
+    int stripeSectors = (deviceNum-parityNum) * chunkSectors;
+    int stripe = secNum / stripeSectors;
+    return stripe * chunkSectors + secNum % chunkSectors;
+}
 
-                // Read old parity for given row
-                ret = driveRead(parityDrive, physSector, oldParity, 1);
-                if (ret != 1){
-                    raidStatus = RAID_FAILED;
-                    break;
-                }
+void CRaidVolume::getRowRange(int secNr, int secCnt, int &firstRow, int &lastRow) {
+    int lastSector = secNr + secCnt - 1;
 
-                // Xor out old data
-                XORSectors(oldParity, oldData);
-                // XOR in new data
-                XORSectors(oldParity, dataTmp);
+    // Request inside of one chunk only touches its own rows, otherwise whole stripes
+    if (secNr / chunkSectors == lastSector / chunkSectors){
+        firstRow = getPhysicalSector(secNr);
+        lastRow = getPhysicalSector(lastSector);
+        return;
+    }
 
-                // Write new parity
-                ret = driveWrite(parityDrive, physSector, oldParity, 1);
-                if ( ret != 1 ){
-                    raidStatus = RAID_FAILED;
-                    break;
-                }
+    int stripeSectors = (deviceNum-parityNum) * chunkSectors;
+    firstRow = secNr / stripeSectors * chunkSectors;
+    lastRow = lastSector / stripeSectors * chunkSectors + chunkSectors - 1;
+}
 
-            } else {
-                ret = driveRead(physDrive, physSector, oldData, 1);
-                if (ret != 1){
-                    raidStatus = RAID_FAILED;
-                    break;
-                }
+// Sectors of the request locked at once. A request over fewer stripes than there are locks takes
+// them all, a longer one goes in windows of half of the locks, so other requests still get through.
+int CRaidVolume::lockWindow(int secNr, int secCnt) {
+    int stripeSectors = (deviceNum-parityNum) * chunkSectors;
+    int first = secNr / stripeSectors;
+    if ((secNr + secCnt - 1) / stripeSectors - first + 1 < RAID_STRIPE_LOCKS){
+        return secCnt;
+    }
+    return (first + RAID_STRIPE_LOCKS / 2) * stripeSectors - secNr;
+}
 
-                // recalculate parity IF PARITY DRIVE WORKS
-                if (raidFailedDrive != parityDrive){
-                    // Read old parity for given row
-                    ret = driveRead(parityDrive, physSector, oldParity, 1);
-                    if (ret != 1){
-                        raidStatus = RAID_FAILED;
-                        break;
-                    }
+template <typename F>
+void CRaidVolume::forEachSector(TRowBatch &batch, int secNr, int secCnt, F callback) {
+    int stripeSectors = (deviceNum-parityNum) * chunkSectors;
+    int lastRow = batch.m_FirstRow + batch.m_Rows;
 
-                    // Xor out old data
-                    XORSectors(oldParity, oldData);
-                    // XOR in new data
-                    XORSectors(oldParity, dataTmp);
+    // Going through stripes of the batch, every chunk holds a run of consecutive sectors
+    for (int stripe = batch.m_FirstRow / chunkSectors; stripe * chunkSectors < lastRow; stripe++){
+        int stripeRow = stripe * chunkSectors;
+        int fromRow = max(batch.m_FirstRow, stripeRow);
+        int toRow = min(lastRow, stripeRow + chunkSectors);
 
-                    // Write new parity
-                    ret = driveWrite(parityDrive, physSector, oldParity, 1);
-                    if ( ret != 1 ){
-                        raidStatus = RAID_FAILED;
-                        break;
-                    }
-                }
+        for (int chunk = 0; chunk < deviceNum-parityNum; chunk++){
+            int chunkSector = stripe * stripeSectors + chunk * chunkSectors;
+            int from = max(secNr, chunkSector + fromRow - stripeRow);
+            int to = min(secNr + secCnt, chunkSector + toRow - stripeRow);
+            int drive = getDataDrive(stripeRow, chunk);
 
-                // Write new data
-                ret = driveWrite(physDrive, physSector, dataTmp, 1);
-                if ( ret != 1 ){
-                    raidStatus = RAID_FAILED;
-                    break;
-                }
+            for (int currentSector = from; currentSector < to; currentSector++){
+                callback(currentSector, drive, stripeRow + currentSector - chunkSector);
             }
         }
+    }
+}
+
+bool CRaidVolume::WriteService(int driveID, int serviceData) {
+    alignas(RAID_IO_ALIGN) char sector[SECTOR_SIZE];
+
+    // Writing service data to last sector, in turn with other requests on the drive
+    std::lock_guard<std::recursive_mutex> lock(stateMutex);
+    unsigned long long seq = fillService(sector, serviceData);
+    bool ok = false;
+    drivePool.Run(1 << driveID, [&](int i){
+        ok = writeServiceSector(i, sector, seq);
+    });
+    return ok;
+}
+
+// Fills the sector with the current state under stateMutex, the result numbers it among the sectors
+// filled so far
+unsigned long long CRaidVolume::fillService(char *sector, int serviceData) {
+    memset(sector, 0, SECTOR_SIZE);
 
-        if (raidStatus == RAID_FAILED){
+    TRaidService service;
+    service.m_Timestamp = serviceData;
+    service.m_ChunkSectors = chunkSectors;
+    service.m_RebuildDrive = rebuildId ? raidFailedDrive : -1;
+    service.m_RebuildDrive2 = rebuildId ? raidFailedDrive2 : -1;
+    service.m_RebuildRow = rebuildRow;
+    service.m_RebuildId = rebuildId;
+    service.m_RebuildDirty = rebuildDirty;
+    service.m_BitmapRows = bitmapRows;
+    service.m_DegradedSince = raidStatus == RAID_DEGRADED ? degradedSince : 0;
+    service.m_ParityDrives = parityNum;
+    memcpy(sector, &service, sizeof(service));
+    return ++serviceSeq;
+}
+
+// Service sectors of a drive may be written by several threads at once (the resync checkpoint
+// is written in the background), one filled earlier must not land over a later one
+bool CRaidVolume::writeServiceSector(int drive, const char *sector, unsigned long long seq) {
+    std::lock_guard<std::mutex> lock(serviceMutex[drive]);
+    if (serviceWritten[drive] > seq){
+        return true;
+    }
+    serviceWritten[drive] = seq;
+    return writeDrive(drive, sectorNum-1, sector, 1) == 1;
+}
+
+bool CRaidVolume::writeServices(void) {
+    std::lock_guard<std::recursive_mutex> lock(stateMutex);
+    // Drives in sync keep the resync progress next to their timestamp
+    for (int i = 0; i < deviceNum; i++){
+        if (!(failedDrives() & (1 << i)) && !WriteService(i, raidServiceData)){
             return false;
         }
+    }
+    return true;
+}
 
-        dataTmp = dataTmp + SECTOR_SIZE;
+int CRaidVolume::failedDrives(void) {
+    std::lock_guard<std::recursive_mutex> lock(stateMutex);
+    int mask = 0;
+    if (raidStatus == RAID_DEGRADED){
+        mask |= raidFailedDrive >= 0 ? 1 << raidFailedDrive : 0;
+        mask |= raidFailedDrive2 >= 0 ? 1 << raidFailedDrive2 : 0;
     }
+    return mask;
+}
 
-    return true;
+int CRaidVolume::rowFailedDrives(int row) {
+    // Rows below the checkpoint are already rebuilt, the drives are used as healthy there
+    std::lock_guard<std::recursive_mutex> lock(stateMutex);
+    if (row < rebuildRow){
+        return 0;
+    }
+    return failedDrives();
 }
 
-int CRaidVolume::Resync(void) {
+bool CRaidVolume::readBitmap(void) {
+    alignas(RAID_IO_ALIGN) unsigned char sector[SECTOR_SIZE];
 
-    if (raidStatus == RAID_FAILED || raidStatus == RAID_STOPPED || raidStatus == RAID_OK){
-        return raidStatus;
+    // Bits of all drives in sync are merged, a crash may have left the bitmap on some of them only
+    std::vector<unsigned char> bits(SECTOR_SIZE, 0);
+    for (int i = 0; i < deviceNum; i++){
+        if (failedDrives() & (1 << i)){
+            continue;
+        }
+        if (readDrive(i, sectorNum-2, sector, 1) != 1){
+            if (!failDrives(1 << i)){
+                return false;
+            }
+            continue;
+        }
+        for (int j = 0; j < SECTOR_SIZE; j++){
+            bits[j] |= sector[j];
+        }
     }
 
-    char sector[SECTOR_SIZE];
+    std::lock_guard<std::mutex> lock(bitmapMutex);
+    bitmap = bits;
+    bitmapActive = bitmap;
+    bitmapWriters.assign(SECTOR_SIZE * 8, 0);
+    bitmapSetVersions.assign(SECTOR_SIZE * 8, 0);
+    bitmapWrites = 0;
+    bitmapVersion = 0;
+    bitmapWritten = 0;
+    bitmapWriting = false;
+    return true;
+}
+
+bool CRaidVolume::writeBitmap(const unsigned char *sector) {
+    int drives = 0;
+    for (int i = 0; i < deviceNum; i++){
+        if (!(failedDrives() & (1 << i))){
+            drives |= 1 << i;
+        }
+    }
 
-    for (int i = 0; i < sectorNum-1; i++){
+    bool failed[MAX_RAID_DEVICES] = {};
+    drivePool.Run(drives, [&](int i){
+        failed[i] = writeDrive(i, sectorNum-2, sector, 1) != 1;
+    });
 
-        if (!calculateDegradedSector(sector, raidFailedDrive, i)){
-            raidStatus = RAID_FAILED;
-            return raidStatus;
+    int mask = 0;
+    for (int i = 0; i < deviceNum; i++){
+        if (failed[i]){
+            mask |= 1 << i;
         }
+    }
 
-        int ret = driveWrite(raidFailedDrive, i, sector, 1);
-        if (ret != 1){
-            raidStatus = RAID_DEGRADED;
-            return raidStatus;
+    return !mask || failDrives(mask);
+}
+
+// Writes the bitmap until the version is on disk. Threads waiting meanwhile are covered by the
+// next write, which takes all changes made until it starts.
+bool CRaidVolume::syncBitmap(std::unique_lock<std::mutex> &lock, unsigned long long version) {
+    bool ok = true;
+    while (bitmapWritten < version){
+        if (bitmapWriting){
+            bitmapCond.wait(lock);
+            continue;
         }
+        bitmapWriting = true;
+        unsigned long long writing = bitmapVersion;
+        alignas(RAID_IO_ALIGN) unsigned char sector[SECTOR_SIZE];
+        memcpy(sector, bitmap.data(), SECTOR_SIZE);
 
+        lock.unlock();
+        ok = writeBitmap(sector);
+        lock.lock();
+
+        // Raid failed by the write takes no more writes, so nobody waits for another try
+        bitmapWrote(lock, writing, ok);
     }
+    return ok;
+}
 
-    if (!WriteService(raidFailedDrive, raidServiceData)){
-        raidStatus = RAID_DEGRADED;
-        return raidStatus;
+// Starts a write of the bitmap for the async waiters unless one is running. Drive threads write it
+// and an async worker finishes it, nobody waits for it.
+void CRaidVolume::startBitmapWrite(std::unique_lock<std::mutex> &lock) {
+    if (bitmapWriting || bitmapWaiters.empty()){
+        return;
     }
+    bitmapWriting = true;
+    unsigned long long writing = bitmapVersion;
+    std::shared_ptr<TRowBatch> sector(new TRowBatch());
+    sector->Init(1, 0, 1);
+    memcpy(sector->Sector(0, 0), bitmap.data(), SECTOR_SIZE);
+    lock.unlock();
 
-    raidStatus = RAID_OK;
-    raidFailedDrive = -1;
-    return raidStatus;
+    int drives = ((1 << deviceNum) - 1) & ~failedDrives();
+    std::shared_ptr<std::atomic<int> > failed(new std::atomic<int>(0));
+    drivePool.RunAsync(drives, [this, sector, failed](int i){
+        if (writeDrive(i, sectorNum-2, sector->Sector(0, 0), 1) != 1){
+            failed->fetch_or(1 << i);
+        }
+    }, [this, writing, failed]{
+        postAsync([this, writing, failed]{
+            bool ok = !*failed || failDrives(*failed);
+            std::unique_lock<std::mutex> lock(bitmapMutex);
+            bitmapWrote(lock, writing, ok);
+        });
+    });
+    lock.lock();
 }
 
-void CRaidVolume::XORSectors(char* result, const char *sector) {
+// Bitmap of the version is on disk, whoever waited for it goes on
+void CRaidVolume::bitmapWrote(std::unique_lock<std::mutex> &lock, unsigned long long written, bool ok) {
+    bitmapWriting = false;
+    bitmapWritten = written;
+    bitmapCond.notify_all();
 
-    // Iterating through array as bytes and xoring them
-    for (int i = 0; i < SECTOR_SIZE; i++ ){
-        result[i] = result[i] ^ sector[i];
+    for (auto it = bitmapWaiters.begin(); it != bitmapWaiters.end(); ){
+        if (it->first <= written){
+            postAsync(std::bind(it->second, ok));
+            it = bitmapWaiters.erase(it);
+        } else {
+            ++it;
+        }
     }
-
+    startBitmapWrite(lock);
 }
 
-CRaidVolume::CRaidVolume(){
-    raidStatus = RAID_STOPPED;
-    raidServiceData = 0;
-    sectorNum = 0;
-    deviceNum = 0;
-    driveRead = NULL;
-    driveWrite = NULL;
+// Sets the bits of the rows, returns the version that has to be on disk before they are written
+unsigned long long CRaidVolume::setDirty(int firstRow, int lastRow) {
+    unsigned long long version = 0;
+    if (++bitmapWrites >= RAID_BITMAP_SWEEP){
+        bitmapWrites = 0;
+        version = sweepBitmap();
+    }
+
+    // Bit set by another write may not be on disk yet either
+    for (int region = firstRow / bitmapRows; region <= lastRow / bitmapRows; region++){
+        unsigned char bit = 1 << (region % 8);
+        bitmapActive[region / 8] |= bit;
+        bitmapWriters[region]++;
+        if (!(bitmap[region / 8] & bit)){
+            bitmap[region / 8] |= bit;
+            bitmapSetVersions[region] = ++bitmapVersion;
+        }
+        version = max(version, bitmapSetVersions[region]);
+    }
+    return version;
 }
 
-bool CRaidVolume::Create(const TBlkDev &dev) {
+bool CRaidVolume::markDirty(int firstRow, int lastRow) {
+    if (bitmapRows == 0){
+        return true;
+    }
 
-    char sector[SECTOR_SIZE];
-    memset(sector, 0, SECTOR_SIZE);
+    // Bits have to be on disk before the rows are written
+    std::unique_lock<std::mutex> lock(bitmapMutex);
+    return syncBitmap(lock, setDirty(firstRow, lastRow));
+}
 
-    int *service = (int*)sector;
-    service[0] = 42;
+// Like markDirty, but done is called once the bits are on disk instead of waiting for them
+void CRaidVolume::markDirtyAsync(int firstRow, int lastRow, std::function<void(bool)> done) {
+    if (bitmapRows == 0){
+        done(true);
+        return;
+    }
 
-    // Writing initial service data to all drives' last sector
-    for (int i = 0; i < dev.m_Devices; i++){
-        int ret = dev.m_Write(i, dev.m_Sectors-1, service, 1);
-        if (ret != 1){
-            return false;
-        }
+    std::unique_lock<std::mutex> lock(bitmapMutex);
+    unsigned long long version = setDirty(firstRow, lastRow);
+    if (bitmapWritten >= version){
+        lock.unlock();
+        done(true);
+        return;
     }
-    return true;
+    bitmapWaiters.push_back(std::make_pair(version, std::move(done)));
+    startBitmapWrite(lock);
 }
 
-//todo Check if the calculations work
-int CRaidVolume::getPhysicalDrive(int secNum) {
-    // for parity balancing
-    // int row = getPhysicalSector(secNum)
-    // get on which drive is parity
-    // secNum % (deviceNum)
-    // if >= parity then +1
+void CRaidVolume::doneDirty(int firstRow, int lastRow) {
+    if (bitmapRows == 0){
+        return;
+    }
 
-    int row = getPhysicalSector(secNum);
-    int parityDrive = getParityDrive(row);
-    int drive = secNum % (deviceNum-1);
+    std::lock_guard<std::mutex> lock(bitmapMutex);
+    for (int region = firstRow / bitmapRows; region <= lastRow / bitmapRows; region++){
+        bitmapWriters[region]--;
+    }
+}
 
-    if (drive >= parityDrive){
-        drive++;
+// Clears regions not written since the last sweep, returns the version that has them on disk,
+// 0 if nothing changed
+unsigned long long CRaidVolume::sweepBitmap(void) {
+    // Only raid in sync forgets regions, a failed drive needs all of them for its resync
+    if (bitmapRows == 0 || raidStatus != RAID_OK){
+        return 0;
     }
 
-    return drive;
+    // Regions not written since the last sweep are clean, unless a write there is still running
+    for (size_t region = 0; region < bitmapWriters.size(); region++){
+        if (bitmapWriters[region] > 0){
+            bitmapActive[region / 8] |= 1 << (region % 8);
+        }
+    }
+    unsigned long long version = 0;
+    if (bitmap != bitmapActive){
+        bitmap = bitmapActive;
+        version = ++bitmapVersion;
+    }
+    std::fill(bitmapActive.begin(), bitmapActive.end(), 0);
+    return version;
 }
 
-int CRaidVolume::getParityDrive(int row){
-    return row % deviceNum;
+bool CRaidVolume::regionDirty(int firstRow, int lastRow) {
+    std::lock_guard<std::mutex> lock(bitmapMutex);
+    for (int region = firstRow / bitmapRows; region <= lastRow / bitmapRows; region++){
+        if (bitmap[region / 8] & (1 << (region % 8))){
+            return true;
+        }
+    }
+    return false;
 }
 
-int CRaidVolume::getPhysicalSector(int secNum) {
-    int drive = secNum % (deviceNum-1);
-    int sector = (secNum - drive) / (deviceNum - 1);
-    return sector;
-}
+bool CRaidVolume::resyncParity(void) {
+    TRowBatch batch;
+    std::vector<char> sectors;
 
-bool CRaidVolume::WriteService(int driveID, int serviceData) {
-    char sector[SECTOR_SIZE];
-    memset(sector, 0, SECTOR_SIZE);
+    // Parity of dirty regions is calculated again from the data
+    for (int region = 0; region * bitmapRows < rowNum; region++){
+        if (!(bitmap[region / 8] & (1 << (region % 8)))){
+            continue;
+        }
 
-    // Casting so we can simply write the value in it
-    int *service = (int*)sector;
+        int lastRow = min(rowNum, (region+1) * bitmapRows);
+        for (int row = region * bitmapRows, count; row < lastRow; row += count){
+            count = min(RAID_BATCH_ROWS, lastRow - row);
+            batch.Init(deviceNum, row, count);
 
-    service[0] = serviceData;
+            sectors.assign(deviceNum * count, 1);
+            int failed = batchIO(batch, sectors, false);
+            if (failed){
+                failDrives(failed);
+                return false;
+            }
 
-    // Writing service data to last sector
-    int ret = driveWrite(driveID, sectorNum-1, sector, 1);
-    if (ret != 1){
-        return false;
+            std::fill(sectors.begin(), sectors.end(), 0);
+            encodeRows(batch, row, count, (1 << deviceNum) - 1);
+            for (int physSector = row; physSector < row + count; physSector++){
+                int parity = getParityDrives(physSector);
+                for (int i = 0; i < deviceNum; i++){
+                    if (parity & (1 << i)){
+                        sectors[i * count + physSector - row] = 1;
+                    }
+                }
+            }
+
+            failed = batchIO(batch, sectors, true);
+            if (failed){
+                failDrives(failed);
+                return false;
+            }
+        }
     }
 
-    return true;
+    std::unique_lock<std::mutex> lock(bitmapMutex);
+    std::fill(bitmap.begin(), bitmap.end(), 0);
+    std::fill(bitmapActive.begin(), bitmapActive.end(), 0);
+    return syncBitmap(lock, ++bitmapVersion);
 }
 
-int CRaidVolume::ReadService(int driveID) {
-    char sector[SECTOR_SIZE];
+int CRaidVolume::ReadService(int driveID, TRaidService *service) {
+    alignas(RAID_IO_ALIGN) char sector[SECTOR_SIZE];
     memset(sector, 0, SECTOR_SIZE);
 
-    // Casting so we can simply write the value in it
-    int *service = (int*)sector;
-
     // Read service data from last sector
-    int ret = driveRead(driveID, sectorNum-1, sector, 1);
+    int ret = 0;
+    drivePool.Run(1 << driveID, [&](int i){
+        ret = readDrive(i, sectorNum-1, sector, 1);
+    });
     if (ret != 1){
         return -1;
     }
 
-    return service[0];
+    TRaidService data;
+    memcpy(&data, sector, sizeof(data));
+    if (service){
+        *service = data;
+    }
+
+    return data.m_Timestamp;
 }
 
 int CRaidVolume::Status(void) const {
     return raidStatus;
 }
 
-int CRaidVolume::Size(void) const {
-    // number of devides * sectornum gives max number of usable sectors
-    // We need to remove sectors used for service
-    int size = (deviceNum-1) * (sectorNum - 1);
-    return size;
+double CRaidVolume::ResyncRate(void) const {
+    return resyncRate;
+}
+
+void CRaidVolume::SetCacheSize(int rows) {
+    cacheRows = max(rows, 0);
+    cache.Init(deviceNum, cacheRows, chunkSectors);
 }
 
-bool CRaidVolume::calculateDegradedSector(char *result, int degDrive, int row) {
+long long CRaidVolume::CacheHits(void) const {
+    return cache.Hits();
+}
+
+long long CRaidVolume::CacheMisses(void) const {
+    return cache.Misses();
+}
 
-    char sector[SECTOR_SIZE];
-    memset(sector,0,SECTOR_SIZE);
+TRaidStats CRaidVolume::GetStats(void) const {
+    return stats.Snapshot();
+}
 
-    // todo check if i can use dataTmp
-    // check if this data setting works
-    for (int i = 0; i < SECTOR_SIZE; i++){
-        result[i] = 0;
+TRaidLatency CRaidVolume::GetLatency(int path, int drive) const {
+    TRaidLatency none = {};
+#if defined(RAID_LATENCY)
+    switch (path){
+        case RAID_PATH_READ:
+            return latency->m_Read.Snapshot();
+        case RAID_PATH_WRITE:
+            return latency->m_Write.Snapshot();
+        case RAID_PATH_RESYNC_ROW:
+            return latency->m_ResyncRow.Snapshot();
+        case RAID_PATH_DRIVE_READ:
+            return drive >= 0 && drive < MAX_RAID_DEVICES ? latency->m_DriveRead[drive].Snapshot() : none;
+        case RAID_PATH_DRIVE_WRITE:
+            return drive >= 0 && drive < MAX_RAID_DEVICES ? latency->m_DriveWrite[drive].Snapshot() : none;
     }
+#else
+    (void)path;
+    (void)drive;
+#endif
+    return none;
+}
 
-    // Going through drives and picking particular sector as a row
-    for (int i = 0; i < deviceNum; i++){
-        // Skip bad drive
-        if (i == degDrive){
-            continue;
-        }
+bool CRaidVolume::DumpTrace(const char *fileName) const {
+#if defined(RAID_TRACE)
+    return tracer.Dump(fileName);
+#else
+    (void)fileName;
+    return false;
+#endif
+}
 
-        // read sector from drive
-        int ret = driveRead(i, row, sector, 1);
-        if (ret != 1){
-            //raidFailedDrive = i;
-            return false;
-        }
+void CRaidVolume::SetWriteBack(bool enable) {
+    if (enable == writeBack){
+        return;
+    }
+    if (!enable){
+        stopFlusher();
+    }
+    writeBack = enable;
+    if (raidStatus != RAID_OK && raidStatus != RAID_DEGRADED){
+        return;
+    }
+    if (enable){
+        startFlusher();
+    } else {
+        flushBuffer(true);
+    }
+}
 
-        XORSectors(result, sector);
+bool CRaidVolume::Flush(void) {
+    if (raidStatus != RAID_OK && raidStatus != RAID_DEGRADED){
+        return false;
     }
+    return flushBuffer(true);
+}
 
-    return true;
+void CRaidVolume::SetQueueDepth(int calls) {
+    queueDepth = max(calls, 1);
 }
 
+int CRaidVolume::Size(void) const {
+    // number of devides * rows gives max number of usable sectors
+    // Service sector and rows after the last whole chunk are not counted
+    int size = (deviceNum-parityNum) * rowNum;
+    return size;
+}
 
 #ifndef __PROGTEST__
+#ifdef RAID_BENCH
+#include "bench.inc"
+#else
 #include "tests.inc"
+#endif /* RAID_BENCH */
 #endif /* __PROGTEST__ */
\ No newline at end of file